@@ -5,6 +5,8 @@ import logging
 import sys
 import os
 import re
+import struct
+import json
 
 # ----------------- CONFIGURATION -----------------
 # Common Arduino ports - will try each in order
@@ -18,6 +20,19 @@ ARDUINO_PORTS = [
 ]
 ARDUINO_BAUD = 115200
 READ_INTERVAL = 0.05  # seconds between read cycles
+HEARTBEAT_INTERVAL = 5.0  # PING period; the Arduino goes standalone after 30s of silence
+
+# Dispense journal record layout (see JournalRecord in arduinocode.ino)
+JOURNAL_RECORD = struct.Struct("<HHHHHhHBB")
+JOURNAL_FIELDS = ("target_ml", "pulses", "duration_ds", "peak_flow_x10",
+                  "mean_flow_x10", "overshoot_pulses", "pulses_per_liter",
+                  "end_reason", "seq")
+
+# Money events (EVT:seq,...,epoch) already booked by the UI, kept across restarts
+SEEN_EVENTS_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "coin_outbox_seen.json")
+SEEN_EVENTS_KEEP = 64   # well over the Arduino's 16-entry outbox
+EVT_STANDALONE = 0x01
+EVT_CHARGING = 0x02
 
 # -------------------------------------------------
 
@@ -42,6 +57,9 @@ class ArduinoListener:
         self._processed_lines = []  # Track processed message hashes
         self._last_coin_time = 0    # Last coin processing time
         self._last_coin_value = 0   # Last coin value processed
+        self._seen_event_seqs = self._load_seen_events()
+        self._outbox_protocol = False  # firmware sends EVT: lines; COIN: is informational
+        self._last_ping_time = 0
         
         # ... rest of initialization ...
 
@@ -107,6 +125,9 @@ class ArduinoListener:
                 else:
                     self.logger.info("Arduino connected (no response to STATUS)")
                 
+                # Fetch money events we may have missed while the port was closed
+                self.ser.write(b"RESYNC\n")
+
                 self.connected = True
                 self.actual_port = port
                 self.logger.info(f"SUCCESS: ArduinoListener connected on {port} @ {self.baud_rate} baud")
@@ -180,8 +201,14 @@ class ArduinoListener:
                 if current_time - last_reset_time >= 1.0:
                     self.coin_event_count = 0
                     last_reset_time = current_time
+
+                # Heartbeat keeps the Arduino out of standalone mode
+                if current_time - self._last_ping_time >= HEARTBEAT_INTERVAL:
+                    self._last_ping_time = current_time
+                    self.ser.write(b"PING\n")
                 
-                if self.ser and self.ser.is_open and self.ser.in_waiting > 0:
+                # Drain everything waiting; progress frames arrive at up to 20 Hz
+                while self.ser and self.ser.is_open and self.ser.in_waiting > 0:
                     line = self.ser.readline().decode("utf-8", errors="ignore").strip()
                     if line:
                         self._process_line(line)
@@ -225,6 +252,8 @@ class ArduinoListener:
         
         # 1. COIN MESSAGES - Single format: "COIN:1", "COIN:5", "COIN:10"
         if line_stripped.startswith("COIN:"):
+            if self._outbox_protocol:
+                return  # the EVT: line for this coin has been handled already
             try:
                 # Extract just the number after "COIN:"
                 coin_str = line_stripped.split("COIN:")[1].strip()
@@ -274,7 +303,72 @@ class ArduinoListener:
                 self.logger.warning(f"Failed to parse animation: {e}")
             return
         
-        # 3. IGNORE ALL COIN-RELATED DEBUG MESSAGES
+        # 3. Live dispense progress: "DP:<ml x10>,<flow mL/s x10>,<eta ms>"
+        elif line_stripped.startswith("DP:"):
+            try:
+                ml_x10, flow_x10, eta_ms = (int(v) for v in line_stripped[3:].split(","))
+                progress = {
+                    "dispensed_ml": ml_x10 / 10.0,
+                    "flow_ml_s": flow_x10 / 10.0,
+                    "eta_seconds": None if eta_ms >= 65535 else eta_ms / 1000.0,
+                }
+                self._dispatch_event("dispense_progress", progress, line_stripped)
+            except ValueError as e:
+                self.logger.debug(f"Failed to parse progress frame: {e} - Line: {line_stripped}")
+            return
+
+        # 4. Binary dispense journal dump: header line, then raw bytes
+        elif line_stripped.startswith("JOURNAL_BIN:"):
+            try:
+                size = int(line_stripped.split(":")[1])
+                data = self.ser.read(size + 1)[:size]  # trailing newline
+                self._dispatch_event("journal", self._parse_journal(data), line_stripped)
+            except Exception as e:
+                self.logger.warning(f"Failed to read journal: {e}")
+            return
+
+        # 5. Sequenced money events: "EVT:<seq>,<coin>,<amount>,<tag>,<flags>,<age s>,<epoch>"
+        elif line_stripped.startswith("EVT:"):
+            self._outbox_protocol = True
+            try:
+                fields = [int(v) for v in line_stripped[4:].split(",")]
+                if len(fields) == 6:
+                    fields.append(0)  # firmware from before the outbox epoch
+                seq, coin, amount, tag, flags, age, epoch = fields
+            except ValueError as e:
+                self.logger.warning(f"Failed to parse EVT message: {e} - Line: {line_stripped}")
+                return
+            if self._event_seen(epoch, seq):
+                # Ack duplicates too; the first ack may be what got lost
+                self.logger.debug(f"Duplicate money event #{seq} ignored")
+                self.send_command(f"ACK:{seq}")
+                return
+            if flags & EVT_STANDALONE:
+                sale = {
+                    "epoch": epoch,
+                    "seq": seq,
+                    "coin": coin,
+                    "ml": amount,
+                    "timestamp": None if age >= 65535 else time.time() - age,
+                }
+                self.logger.info(f"STANDALONE SALE #{seq}: P{coin} -> {amount}mL")
+                # Only a handler that booked the sale may let the Arduino drop it
+                booked = self._dispatch_event("standalone_sale", sale, line_stripped) is True
+            else:
+                self.logger.info(f"COIN DETECTED: P{coin} (event #{seq})")
+                booked = self._dispatch_event("coin", coin, line_stripped) is not False
+            if not booked:
+                self.logger.warning(f"Money event #{seq} not booked; leaving it for the Arduino to resend")
+                return
+            self._mark_event_seen(epoch, seq)
+            self.send_command(f"ACK:{seq}")
+            return
+
+        elif line_stripped.startswith("STANDALONE:"):
+            self.logger.warning(f"[Arduino] {line_stripped}")
+            return
+
+        # 6. IGNORE ALL COIN-RELATED DEBUG MESSAGES
         coin_debug_keywords = [
             "Coin accepted:",
             "DEBUG: Received",
@@ -292,7 +386,7 @@ class ArduinoListener:
                 self.logger.debug(f"Ignoring coin debug: {line_stripped[:50]}...")
                 return
         
-        # 4. Log other messages
+        # 7. Log other messages
         if "DEBUG:" in line_stripped:
             self.logger.debug(f"[Arduino Debug] {line_stripped}")
         elif "ERROR:" in line_stripped:
@@ -303,8 +397,61 @@ class ArduinoListener:
             self.logger.debug(f"[Arduino] {line_stripped}")
             
         
+    def _parse_journal(self, data):
+        """Decode a JOURNAL_BIN payload into a list of record dicts."""
+        if len(data) < 3:
+            raise ValueError("journal payload too short")
+        count, rec_size = data[0], data[1]
+        checksum = 0
+        for b in data[:-1]:
+            checksum ^= b
+        if checksum != data[-1] or rec_size != JOURNAL_RECORD.size:
+            raise ValueError("journal checksum or record size mismatch")
+        records = []
+        for i in range(count):
+            fields = JOURNAL_RECORD.unpack_from(data, 2 + i * rec_size)
+            records.append(dict(zip(JOURNAL_FIELDS, fields)))
+        return records
+
+    def _load_seen_events(self):
+        """Seen money events as [epoch, seq] pairs (bare seqs from older files are epoch 0)."""
+        try:
+            with open(SEEN_EVENTS_FILE) as f:
+                seen = json.load(f)
+        except (OSError, ValueError):
+            return []
+        return [e if isinstance(e, list) else [0, e] for e in seen]
+
+    def _event_seen(self, epoch, seq):
+        """True if this money event was booked before."""
+        return [epoch, seq] in self._seen_event_seqs
+
+    def _mark_event_seen(self, epoch, seq):
+        """Record a booked money event; False if it was handled before.
+
+        Events are keyed on (epoch, seq): the Arduino picks a new epoch
+        whenever its outbox restarts numbering, so a reflash cannot make
+        fresh events look like old ones.
+        """
+        if self._event_seen(epoch, seq):
+            return False
+        # Within one epoch a far lower number means the counter was reset
+        same = [s for e, s in self._seen_event_seqs if e == epoch]
+        if same and seq < max(same) - SEEN_EVENTS_KEEP:
+            self._seen_event_seqs = [p for p in self._seen_event_seqs if p[0] != epoch]
+        self._seen_event_seqs = (self._seen_event_seqs + [[epoch, seq]])[-SEEN_EVENTS_KEEP:]
+        try:
+            with open(SEEN_EVENTS_FILE, "w") as f:
+                json.dump(self._seen_event_seqs, f)
+        except OSError as e:
+            self.logger.warning(f"Could not persist money event log: {e}")
+        return True
+
     def _dispatch_event(self, event, value, raw_line):
-        """Dispatch event to all registered callbacks."""
+        """Dispatch event to all registered callbacks.
+
+        Returns what the main callback returned, or False if it raised.
+        """
         print(f"DEBUG _dispatch_event: event='{event}', value={value}, raw='{raw_line}'")
         
         payload = {
@@ -315,14 +462,16 @@ class ArduinoListener:
         }
 
         # Send to main event callback (KioskApp)
+        result = None
         if self.event_callback:
             try:
                 print(f"DEBUG: Calling main callback: {self.event_callback}")
-                self.event_callback(event, value)
+                result = self.event_callback(event, value)
             except Exception as e:
                 self.logger.error(f"Error in main event_callback: {e}")
                 import traceback
                 traceback.print_exc()
+                result = False
         else:
             print("DEBUG: No main event_callback set!")
 
@@ -337,6 +486,8 @@ class ArduinoListener:
                 import traceback
                 traceback.print_exc()
 
+        return result
+
     # -------------------------------------------------
     # SEND COMMANDS TO ARDUINO
     # -------------------------------------------------
@@ -398,6 +549,10 @@ class ArduinoListener:
         """Alternative method name for send_command for compatibility."""
         return self.send_command(command)
 
+    def request_journal(self):
+        """Ask the Arduino for its dispense journal (arrives as a 'journal' event)."""
+        return self.send_command("JOURNAL")
+
     def reset_coin_debounce(self):
         """Reset the coin debounce timer (useful for testing)."""
         self.last_coin_time = 0
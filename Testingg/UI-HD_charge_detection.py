@@ -11,6 +11,9 @@ import os
 import re
 import sys
 import glob
+import struct
+
+from timer_status import decode_timer_status
 
 # Try to import firebase_helpers, but continue if not available
 try:
@@ -31,6 +34,9 @@ except ImportError:
 # load pinmap for hardware_gpio
 BASE = os.path.dirname(__file__)
 PINMAP_PATH = os.path.join(BASE, 'pinmap.json')
+# Sales the water Arduino made on its own while the Pi was away (one JSON per line)
+STANDALONE_SALES_PATH = os.path.join(BASE, 'standalone_sales.jsonl')
+DISPENSE_JOURNAL_PATH = os.path.join(BASE, 'dispense_journal.json')
 try:
     with open(PINMAP_PATH, 'r', encoding='utf-8') as _f:
         _pinmap = json.load(_f)
@@ -92,13 +98,22 @@ CHARGE_DB_WRITE_INTERVAL = 10
 UNPLUG_GRACE_SECONDS = 60
 NO_CUP_TIMEOUT = 10
 
-# Charging detection tuning
+# Charging detection tuning. Plug/unplug is decided here from the Pi's own
+# current readings; the timer board's SESSION plug logic (timermodule.ino)
+# is not used yet and stays inactive because SESSION is never sent.
 PLUG_THRESHOLD = 0.10
 UNPLUG_THRESHOLD = 0.07
 UNPLUG_GRACE_SECONDS = 30
 CONFIRM_SAMPLES = 3
 SAMPLE_INTERVAL = 0.5
 
+# Timer board countdowns (see TIME:/DEADLINE: in timermodule.ino). The
+# board runs each slot to an absolute deadline in our monotonic clock, so
+# the countdown is only resent when it moves by more than the tick jitter.
+TIMER_TIME_RESYNC_S = 300        # re-share the clock before a deadline this often
+TIMER_DEADLINE_SLACK_MS = 1500   # a smaller move is tick jitter, not a new deadline
+TIMER_SLOT_SECONDS_MAX = 32767   # SLOT_SECONDS_MAX; longer countdowns use SLOT
+
 # Coin to seconds mapping (charging)
 COIN_MAP = {1: 60, 5: 300, 10: 600}
 
@@ -500,6 +515,9 @@ class KioskApp(tk.Tk):
         # ========== TIMER DISPLAY ARDUINO INITIALIZATION ==========
         self.timer_serial = None
         self.timer_available = False
+        self.timer_status = None  # last decoded STATUS_BIN frame
+        self.timer_deadlines = {}  # slot -> last DEADLINE sent (Pi ms)
+        self.timer_time_sent = None
         self.setup_timer_displays()
 
         # Initialize ArduinoListener for water service hardware integration
@@ -544,24 +562,33 @@ class KioskApp(tk.Tk):
                     )
                     time.sleep(2.5)  # Longer delay for display init
                     
-                    # Clear buffer
+                    # Clear buffer; the boot banner is gone by now, so ask
+                    # for a status frame (older firmware sends READY lines)
                     self.timer_serial.reset_input_buffer()
+                    self.timer_serial.write(b"STATUS_BIN\n")
                     
-                    # Wait for ready message
+                    # Wait for a status frame or ready message
                     timeout = time.time() + 5
                     while time.time() < timeout:
                         if self.timer_serial.in_waiting > 0:
                             response = self.timer_serial.readline().decode('utf-8', errors='ignore').strip()
-                            if "4SLOT_TIMER_READY" in response or "READY" in response:
+                            if response.startswith("STATUS_BIN:"):
+                                self.timer_status = self._read_timer_status(response)
+                                ready = self.timer_status is not None
+                            else:
+                                ready = "READY" in response
+                            if ready:
                                 self.timer_available = True
                                 print(f"SUCCESS: 4-slot timer connected on {port}")
                                 
                                 # Set brightness
                                 self.send_timer_command("BRIGHT:5")
+                                self.timer_time_sent = None
+                                self.timer_deadlines = {}
                                 
                                 # Initialize all slots to "waiting" state
                                 for slot in range(1, 5):
-                                    self.send_timer_command(f"SLOT{slot}:-")
+                                    self.update_timer_display(slot, 0)
                                 
                                 return
                     
@@ -578,6 +605,19 @@ class KioskApp(tk.Tk):
             print(f"ERROR setting up timer displays: {e}")
             self.timer_available = False
     
+    def _read_timer_status(self, header):
+        """Read the binary payload after a STATUS_BIN:<n> line; None if it is bad."""
+        try:
+            size = int(header.split(":")[1])
+            data = self.timer_serial.read(size + 1)[:size]  # trailing newline
+            status = decode_timer_status(data)
+        except (ValueError, IndexError, struct.error) as e:
+            print(f"WARN: Bad timer status frame: {e}")
+            return None
+        print(f"INFO: Timer status v{status['version']}: active={status['active']} "
+              f"remaining={status['remaining']}")
+        return status
+
     def send_timer_command(self, command):
         """Send command to timer Arduino"""
         if not self.timer_available or not self.timer_serial:
@@ -593,18 +633,46 @@ class KioskApp(tk.Tk):
             self.timer_available = False
             return False
     
+    def _timer_clock_ms(self):
+        """The Pi time shared with the timer board: monotonic ms mod 2^32."""
+        return int(time.monotonic() * 1000) & 0xFFFFFFFF
+
     def update_timer_display(self, slot_num, seconds):
-        """Update specific slot's timer display"""
+        """Show a countdown of `seconds` on a slot, or "--" when it is not positive.
+
+        Boards that answered STATUS_BIN understand TIME/DEADLINE: they get
+        one deadline and count down on their own, so calling this every
+        tick sends nothing until the deadline really moves. Older boards
+        get SLOTn:<seconds> every call as before.
+        """
         if not self.timer_available:
             return False
-            
+
         if seconds <= 0:
             # Show "waiting" state
+            self.timer_deadlines.pop(slot_num, None)
             return self.send_timer_command(f"SLOT{slot_num}:-")
-        else:
-            # Update with remaining seconds
+        if self.timer_status is None or seconds > TIMER_SLOT_SECONDS_MAX:
+            self.timer_deadlines.pop(slot_num, None)
             return self.send_timer_command(f"SLOT{slot_num}:{seconds}")
 
+        now = self._timer_clock_ms()
+        if self.timer_time_sent is None or time.monotonic() - self.timer_time_sent > TIMER_TIME_RESYNC_S:
+            if not self.send_timer_command(f"TIME:{now}"):
+                return False
+            self.timer_time_sent = time.monotonic()
+
+        deadline = (now + int(seconds) * 1000) & 0xFFFFFFFF
+        last = self.timer_deadlines.get(slot_num)
+        if last is not None:
+            moved = (deadline - last) & 0xFFFFFFFF
+            if min(moved, 0x100000000 - moved) <= TIMER_DEADLINE_SLACK_MS:
+                return True
+        if not self.send_timer_command(f"DEADLINE:{slot_num}:{deadline}"):
+            return False
+        self.timer_deadlines[slot_num] = deadline
+        return True
+
     def send_arduino_command(self, command):
         """Safely send command to Arduino if available."""
         if not self.arduino_available or not self.arduino_listener:
@@ -859,7 +927,7 @@ class KioskApp(tk.Tk):
                 self.refresh_all_user_info()
                 
             # Route water-specific events to WaterScreen
-            elif event in ['animation_start', 'countdown', 'countdown_end', 'cup_detected', 'dispense_start', 'dispense_done']:
+            elif event in ['animation_start', 'dispense_progress', 'countdown', 'countdown_end', 'cup_detected', 'dispense_start', 'dispense_done']:
                 if self.current_frame == 'WaterScreen':
                     ws = self.frames.get(WaterScreen)
                     if ws and hasattr(ws, 'handle_arduino_event'):
@@ -872,11 +940,44 @@ class KioskApp(tk.Tk):
                 else:
                     print(f"INFO: Water event '{event}' ignored - not in WaterScreen")
                     
+            # Money taken while the Pi was away; the listener acks it only
+            # once this returns True
+            elif event == 'standalone_sale':
+                return self._record_standalone_sale(value)
+
+            elif event == 'journal':
+                self._save_dispense_journal(value)
+
             else:
                 print(f"INFO: Unhandled Arduino event: {event} = {value}")
                 
         except Exception as e:
             print(f"ERROR in Arduino event dispatcher: {e}")
+            return False
+
+    def _record_standalone_sale(self, sale):
+        """Book a standalone sale in the local ledger; True once it is on disk."""
+        try:
+            with open(STANDALONE_SALES_PATH, 'a', encoding='utf-8') as f:
+                f.write(json.dumps(sale) + "\n")
+                f.flush()
+                os.fsync(f.fileno())
+        except OSError as e:
+            print(f"ERROR: Could not record standalone sale {sale}: {e}")
+            return False
+        print(f"INFO: Standalone sale booked: P{sale.get('coin')} -> {sale.get('ml')}mL")
+        # Best effort; the local ledger is the record of the sale
+        append_audit_log(actor='arduino', action='standalone_sale', meta=sale)
+        return True
+
+    def _save_dispense_journal(self, records):
+        """Keep the latest dispense journal dump from the water Arduino."""
+        try:
+            with open(DISPENSE_JOURNAL_PATH, 'w', encoding='utf-8') as f:
+                json.dump({'ts': int(time.time()), 'records': records}, f)
+            print(f"INFO: Saved dispense journal ({len(records)} records)")
+        except OSError as e:
+            print(f"ERROR: Could not save dispense journal: {e}")
 
     def _handle_water_coin(self, uid, coin_value, added_ml):
         """Handle water coin insertion."""
@@ -1608,7 +1709,7 @@ class SlotSelectScreen(tk.Frame):
             
             if not slot:
                 # Slot doesn't exist in DB, show as available
-                self.controller.send_timer_command(f"SLOT{i}:-")
+                self.controller.update_timer_display(i, 0)
                 continue
                 
             status = slot.get("status", "inactive")
@@ -1620,17 +1721,17 @@ class SlotSelectScreen(tk.Frame):
                 if user:
                     remaining = user.get("charge_balance", 0)
                     if remaining > 0:
-                        self.controller.send_timer_command(f"SLOT{i}:{remaining}")
+                        self.controller.update_timer_display(i, remaining)
                     else:
-                        self.controller.send_timer_command(f"SLOT{i}:-")
+                        self.controller.update_timer_display(i, 0)
                 else:
-                    self.controller.send_timer_command(f"SLOT{i}:-")
+                    self.controller.update_timer_display(i, 0)
             elif current_user != "none":
                 # Slot assigned but not active (waiting for plug)
-                self.controller.send_timer_command(f"SLOT{i}:-")
+                self.controller.update_timer_display(i, 0)
             else:
                 # Slot is free/available
-                self.controller.send_timer_command(f"SLOT{i}:-")
+                self.controller.update_timer_display(i, 0)
 
     def refresh(self):
         """Refresh the slot selection screen with current status"""
@@ -1769,7 +1870,7 @@ class SlotSelectScreen(tk.Frame):
         # Update timer display to show slot is assigned (but not yet charging)
         if self.controller.timer_available:
             # Show remaining time on the physical display
-            self.controller.send_timer_command(f"SLOT{i}:{cb}")
+            self.controller.update_timer_display(i, cb)
         
         # Assign slot to user
         try:
@@ -1911,7 +2012,7 @@ class ChargingScreen(tk.Frame):
             return True
         
         try:
-            success = self.controller.send_timer_command(f"SLOT{slot_num}:{self.remaining}")
+            success = self.controller.update_timer_display(slot_num, self.remaining)
             if success:
                 self._last_timer_update = current_time
                 return True
@@ -1992,11 +2093,11 @@ class ChargingScreen(tk.Frame):
             slot_num = self._get_slot_number()
             if slot_num > 0 and self.controller.timer_available:
                 if self.charging_uid == uid and self.is_charging:
-                    self.controller.send_timer_command(f"SLOT{slot_num}:{self.remaining}")
+                    self.controller.update_timer_display(slot_num, self.remaining)
                 elif user.get("charging_status") == "charging":
-                    self.controller.send_timer_command(f"SLOT{slot_num}:{cb}")
+                    self.controller.update_timer_display(slot_num, cb)
                 else:
-                    self.controller.send_timer_command(f"SLOT{slot_num}:-")
+                    self.controller.update_timer_display(slot_num, 0)
             
             # Sync local state with DB
             if user.get("charging_status") == "charging" and self.charging_uid == uid:
@@ -2017,7 +2118,7 @@ class ChargingScreen(tk.Frame):
             self.time_var.set("0")
             if self.controller.timer_available:
                 for slot_num in range(1, 5):
-                    self.controller.send_timer_command(f"SLOT{slot_num}:-")
+                    self.controller.update_timer_display(slot_num, 0)
 
     def start_charging(self):
         uid = self.controller.active_uid
@@ -2046,7 +2147,7 @@ class ChargingScreen(tk.Frame):
         
         # Update timer display
         if self.controller.timer_available and slot_num > 0:
-            self.controller.send_timer_command(f"SLOT{slot_num}:{cb}")
+            self.controller.update_timer_display(slot_num, cb)
             self._last_timer_update = time.time()
 
         # Update DB status
@@ -2302,7 +2403,7 @@ class ChargingScreen(tk.Frame):
         
         # Update timer display
         if self.controller.timer_available and slot_num > 0:
-            self.controller.send_timer_command(f"SLOT{slot_num}:-")
+            self.controller.update_timer_display(slot_num, 0)
         
         # Hardware cleanup
         try:
@@ -2409,7 +2510,7 @@ class ChargingScreen(tk.Frame):
         # Update timer display
         slot_num = self._get_slot_number(slot)
         if self.controller.timer_available and slot_num > 0:
-            self.controller.send_timer_command(f"SLOT{slot_num}:{self.remaining}")
+            self.controller.update_timer_display(slot_num, self.remaining)
         
         # Start tick loop and monitoring
         if self._tick_job is None:
@@ -2549,7 +2650,7 @@ class ChargingScreen(tk.Frame):
         
         # Update timer display
         if self.controller.timer_available and slot_num > 0:
-            self.controller.send_timer_command(f"SLOT{slot_num}:-")
+            self.controller.update_timer_display(slot_num, 0)
         
         try:
             append_audit_log(actor=uid, action='charge_no_device_detected', meta={'slot': slot})
@@ -2610,7 +2711,7 @@ class ChargingScreen(tk.Frame):
         # 3. Update timer display
         if slot_num > 0 and self.controller.timer_available:
             try:
-                self.controller.send_timer_command(f"SLOT{slot_num}:-")
+                self.controller.update_timer_display(slot_num, 0)
                 print(f"[TIMER] Physical timer for slot {slot_num} set to available")
             except Exception as e:
                 print(f"[TIMER] WARN: Could not update timer display: {e}")
@@ -2915,6 +3016,19 @@ class WaterScreen(tk.Frame):
                     print(f"Unexpected animation data type: {type(value)}")
                 return
                 
+            elif event == 'dispense_progress':
+                # Live frames from the Arduino: re-anchor the animation to the
+                # measured volume and predicted completion time
+                if isinstance(value, dict) and self.animation_total_ml > 0:
+                    remaining = max(0, self.animation_total_ml - int(value.get("dispensed_ml", 0)))
+                    self.animation_current_ml = remaining
+                    self.animation_dispensed_so_far = self.animation_total_ml - remaining
+                    eta = value.get("eta_seconds")
+                    if eta is not None:
+                        self.animation_target_end_time = time.time() + eta
+                    self.time_var.set(str(int(remaining)))
+                return
+
             elif event == 'dispense_done':
                 dispensed_ml = 0
                 try:
@@ -3272,7 +3386,7 @@ class WaterScreen(tk.Frame):
         # 3. Update timer display (physical 7-segment) to show slot is available
         if slot_num > 0 and self.controller.timer_available:
             try:
-                self.controller.send_timer_command(f"SLOT{slot_num}:-")
+                self.controller.update_timer_display(slot_num, 0)
                 print(f"[TIMER] Physical timer for slot {slot_num} set to available")
             except Exception as e:
                 print(f"[TIMER] WARN: Could not update timer display: {e}")
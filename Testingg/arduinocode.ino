@@ -7,26 +7,156 @@
 #define CUP_ECHO_PIN      10    // Ultrasonic echo
 #define PUMP_PIN          8     // Pump relay
 #define VALVE_PIN         7     // Solenoid valve relay
+#define COIN_INHIBIT_PIN  4     // Coin acceptor inhibit/enable (spare pin)
+#define COIN_INHIBIT_LEVEL HIGH // level on which the acceptor rejects coins
 
 // ---------------- CONSTaANTS ----------------
 #define COIN_DEBOUNCE_MS  50
 #define COIN_TIMEOUT_MS   800
 #define INACTIVITY_TIMEOUT 300000 // 5 min
 #define CUP_DISTANCE_CM   10.0
+#define CUP_REMOVED_GRACE_MS 3000  // cup may be missing this long before dispensing stops
+#define CUP_CHECK_MS      100   // ultrasonic ping interval while dispensing
+#define IDLE_LOOP_MS      100
+#define DISPENSE_LOOP_MS  10    // fast loop so progress frames can reach 20 Hz
+#define RELAY_BLANK_US    20000 // coin pulses ignored this long after a relay edge
+#define COIN_INHIBIT_GRACE_MS (COIN_TIMEOUT_MS + 200) // a coin taken just before inhibit still pulses out
 
 // ---------------- MODES ----------------
 #define MODE_WATER 0
 #define MODE_CHARGING 1
 
 // ---------------- FLOW CALIBRATION ----------------
-float pulsesPerLiter = 450.0;   // will be overwritten by EEPROM
+// One sanity range for every sketch that shares EEPROM offset 12
+// (the legacy location, read only when migrating to the config store)
+#define PPL_DEFAULT 450.0
+#define PPL_MIN     200
+#define PPL_MAX     10000
+
+float pulsesPerLiter = PPL_DEFAULT;   // will be overwritten by EEPROM
+
+// ---------------- FLOW CURVE ----------------
+// The YF-S201 K-factor changes with flow rate. The curve scales
+// pulsesPerLiter by a Q10 factor (1024 = 1.0) at up to four pulse
+// frequencies, interpolated between points and clamped outside them.
+#define LEGACY_FLOWCURVE_ADDR 16    // pre-config-store location
+#define FLOWCURVE_MAGIC       0x43  // 'C'
+#define FLOWCURVE_POINTS      4
+#define FLOWCAL_POINT_ML      500   // volume collected per curve step
+
+struct FlowCurve {                  // 18 bytes
+  uint8_t  magic;
+  uint8_t  count;                   // 0 = flat, use pulsesPerLiter as is
+  uint16_t freqX10[FLOWCURVE_POINTS];   // Hz x10, ascending
+  uint16_t factorQ10[FLOWCURVE_POINTS];
+};
+
+FlowCurve flowCurve;
+uint16_t flowFreqX10 = 0;           // pulse frequency of the last window
 
 // ---------------- COIN CREDIT SETTINGS ----------------
-uint8_t coin1P_pulses = 1;    // P1 = 1 pulse
-uint8_t coin5P_pulses = 5;    // P5 = 5 pulses
-uint8_t coin10P_pulses = 10;  // P10 = 10 pulses
-
-
+// One row per denomination: the pulse counts that identify it, its peso
+// value and what it buys in each mode. Replaced as a whole with SETTABLE
+// and kept in the config store, so repricing needs no reflash.
+#define COIN_TABLE_MAX    6
+#define COIN_PULSES_MAX   30        // longer trains are noise
+#define COIN_SECONDS_MAX  36000
+
+struct CoinEntry {                  // 9 bytes
+  uint8_t  minPulses;
+  uint8_t  maxPulses;
+  uint8_t  peso;
+  uint16_t ml;                      // water credit
+  uint16_t seconds;                 // charging credit
+  uint16_t standaloneML;            // water credit without the Pi
+};
+
+CoinEntry coinTable[COIN_TABLE_MAX];
+uint8_t coinTableCount = 0;
+
+// ---------------- COIN CALIBRATION ----------------
+// COINCAL[:K] walks the coin table row by row, K insertions per coin, from
+// the main loop. Each row reports its pulse-count range and pulse timing;
+// at the end the count windows are rebuilt from what was seen, widened by
+// COINCAL_MARGIN where that does not reach halfway to a neighbour.
+#define COINCAL_DEFAULT_K   5
+#define COINCAL_MAX_K       10
+#define COINCAL_TIMEOUT_MS  60000UL // per insertion
+#define COINCAL_MARGIN      1       // pulses
+
+struct CoinTiming {                 // 0.1 ms units
+  uint32_t widthSum;
+  uint32_t periodSum;
+  uint16_t widthMin;
+  uint16_t widthMax;
+  uint16_t periodMin;
+  uint16_t periodMax;
+  uint16_t widthN;
+  uint16_t periodN;
+};
+
+CoinTiming coinCalTiming;           // all insertions of the current row
+CoinTiming coinCalAll;              // every row, becomes the timing signature
+bool coinCalActive = false;
+uint8_t coinCalRow = 0;
+uint8_t coinCalSamples = 0;
+uint8_t coinCalK = COINCAL_DEFAULT_K;
+unsigned long coinCalStepMs = 0;
+uint8_t coinCalMin[COIN_TABLE_MAX]; // observed counts; 0 = row skipped
+uint8_t coinCalMax[COIN_TABLE_MAX];
+
+// ---------------- TAMPER DETECTION ----------------
+// A string-pulled coin toggles the line by hand: slow, uneven pulses. Each
+// train is checked against physical limits and, once COINCAL has learned
+// it, the acceptor's own timing signature (0.1 ms units, 0 = not learned).
+// Failing trains earn no credit, raise TAMPER:<reason>,<pulses> and block
+// coins for TAMPER_BLOCK_MS.
+#define PHYS_WIDTH_MIN_X10    50    // 5 ms
+#define PHYS_WIDTH_MAX_X10    2000  // 200 ms
+#define PHYS_PERIOD_MAX_X10   5000  // 500 ms
+#define SIG_TOLERANCE_PCT     30    // beyond the learned min/max
+#define TAMPER_SPREAD_PCT     35    // max period spread vs. mean
+#define TAMPER_BLOCK_MS       30000UL
+
+#define TAMPER_NONE       0
+#define TAMPER_WIDTH      1
+#define TAMPER_PERIOD     2
+#define TAMPER_IRREGULAR  3
+#define TAMPER_SHAPE      4         // pulses without a matching release
+
+struct TimingSignature {
+  uint16_t widthMin;
+  uint16_t widthMax;
+  uint16_t periodMin;
+  uint16_t periodMax;
+};
+
+TimingSignature coinSignature = {0, 0, 0, 0};
+
+// ---------------- COIN HEALTH ----------------
+// Rolling counters for COINSTATS: a ring of STATS_BUCKETS buckets of
+// STATS_BUCKET_MS each, so the window covers the last 21..24 hours. The
+// coin ISR only bumps the three drop counters; the loop folds them into
+// the current bucket. 8-bit counts saturate.
+#define STATS_BUCKETS     8
+#define STATS_BUCKET_MS   (3UL * 3600UL * 1000UL)
+#define STATS_HIST_BINS   16        // unknown trains of 1..15 pulses, 16+ last
+
+struct CoinStatsBucket {            // 30 bytes
+  uint8_t  accepted[COIN_TABLE_MAX];    // per coin table row
+  uint8_t  noise;                   // trains outside 1..COIN_PULSES_MAX
+  uint8_t  unknown;                 // trains matching no row
+  uint8_t  tamper;                  // trains rejected on timing
+  uint16_t gateDrops;               // edges inside the 5 ms gate
+  uint8_t  inflight;                // coins that pulsed out after inhibit was set
+  uint16_t relayDrops;              // edges inside the relay blanking window
+  uint8_t  unknownHist[STATS_HIST_BINS];
+};
+
+CoinStatsBucket coinStats[STATS_BUCKETS];
+uint8_t statsHead = 0;              // bucket being filled
+unsigned long statsBucketStart = 0;
+uint8_t statsFilled = 1;            // buckets holding data, incl. the current one
 
 // ---------------- SYSTEM STATE ----------------
 uint8_t currentMode = MODE_WATER;  // 0=WATER, 1=CHARGING
@@ -35,52 +165,344 @@ uint8_t currentMode = MODE_WATER;  // 0=WATER, 1=CHARGING
 volatile unsigned long lastCoinPulseTime = 0;
 volatile unsigned long lastCoinMicros = 0;
 volatile uint8_t coinPulseCount = 0;
+volatile bool coinPulseOpen = false;           // waiting for its rising edge
+volatile uint8_t* coinPinReg;                  // direct read keeps the ISR short
+uint8_t coinPinMask;
+
+// Edge timestamps of the train being counted: (micros >> 7) in the low 15
+// bits (128 us steps, wraps after 4.2 s), EDGE_RISING marks pulse ends.
+// coinISR only stores; widths and periods are worked out in the loop.
+#define EDGE_RING_SIZE  64          // power of two; 30 pulses = 60 edges
+#define EDGE_RISING     0x8000
+volatile uint16_t edgeRing[EDGE_RING_SIZE];
+volatile uint8_t edgeHead = 0;
+uint8_t edgeTail = 0;               // first edge of the current train
+volatile uint16_t isrGateDrops = 0;            // harvested by handleCoinStats
+volatile uint16_t isrRelayDrops = 0;
 volatile unsigned long flowPulseCount = 0;
 
 // ---------------- COIN BLOCKING ----------------
 volatile bool blockAllCoins = false;
 volatile unsigned long coinBlockUntil = 0;
+volatile unsigned long relayEdgeMicros = 0;   // last PUMP/VALVE switch
+
+// ---------------- COIN INHIBIT ----------------
+// Whenever coins must not be taken, the acceptor's inhibit line makes it
+// return them, instead of the firmware keeping money it won't credit. The
+// coin ISR is detached once coins already in flight have pulsed out.
+#define INHIBIT_BLOCKED   0x01      // BLOCK_COINS or a tamper block
+#define INHIBIT_OUTBOX    0x02      // money outbox full (e.g. long standalone run)
+#define INHIBIT_DISPENSE  0x04      // dispensing, if INHIBIT_DISPENSE ON
+
+uint8_t coinInhibitReasons = 0;
+bool coinIsrAttached = true;
+bool inhibitWhileDispensing = false; // off: coins during a pour go to pending credit
+unsigned long inhibitSinceMs = 0;
+unsigned long inhibitTotalMs = 0;
+uint16_t inhibitCount = 0;
+uint8_t last_inhibit = 0;
 
 // ---------------- SYSTEM STATE ----------------
 bool dispensing = false;
 bool coinInputEnabled = true;
 
 uint16_t creditML = 0;
-uint16_t chargeSeconds = 0;
-unsigned long targetPulses = 0;
+unsigned long targetUL = 0;          // dispense target, microliters
+unsigned long dispensedUL = 0;
+unsigned long lastIntegrateCount = 0;
 unsigned long startFlowCount = 0;
 unsigned long lastActivity = 0;
 
+// ---------------- CREDIT WALLETS ----------------
+// Credit is kept per customer tag assigned by the Pi (TAG:n, 0 = walk-in).
+// Coins go to the active tag's wallet for the current mode, so switching
+// mode never clears anything and water and charging can sell at once.
+// creditML is the water credit of waterTag, the tag the dispenser serves;
+// other tags' water credit waits in their wallets until it is their turn.
+#define WALLET_COUNT 4
+
+struct Wallet {
+  bool used;
+  uint8_t tag;
+  uint16_t creditML;                // water credit not yet at the dispenser
+  uint16_t chargeSeconds;
+};
+
+Wallet wallets[WALLET_COUNT] = {{true, 0, 0, 0}};
+uint8_t activeTag = 0;              // coins are credited to this tag
+uint8_t waterTag = 0;               // owner of creditML
+
 // Serial change detection
 int16_t last_creditML = -1;
+int16_t last_pendingML = -1;
 int16_t last_chargeSeconds = -1;
 bool last_dispensing = false;
 unsigned long last_flowCount = 0;
 
+// Cup removal tracking while dispensing
+bool cupRemovedFlag = false;
+unsigned long cupRemovedTime = 0;
+
+// Coins paid while a dispense is running or settling, served next.
+// A new cup is required before that credit starts pouring.
+uint16_t pendingCreditML = 0;
+bool awaitCupClear = false;
+
+// ---------------- ORDER QUEUE ----------------
+// Back-to-back cups: each order is poured into its own cup, and the cup
+// must be taken away before the next order starts. Orders come from the
+// Pi (ORDER:250,250,500) or, with ORDERMODE COIN, one per coin.
+#define ORDER_QUEUE_SIZE 6
+#define ORDER_MAX_ML     2000
+#define ORDER_BY_CREDIT  0      // legacy: all credit into the first cup
+#define ORDER_BY_COIN    1
+
+uint16_t orderML[ORDER_QUEUE_SIZE];
+uint8_t orderHead = 0;
+uint8_t orderCount = 0;
+uint8_t orderMode = ORDER_BY_CREDIT;
+uint16_t orderSeq = 0;
+bool orderActive = false;           // the running dispense is the head order
+bool orderAwaitRemoval = false;     // finished order waiting for its cup to go
+unsigned long orderReadyMs = 0;     // head order became ready to pour
+unsigned long orderPourStartMs = 0;
+unsigned long orderPourMs = 0;
+uint16_t orderDoneML = 0;
+
+// Pump coast after the valve closes is journaled once it settles
+bool settlePending = false;
+uint8_t settleEndReason = 0;
+unsigned long settleStartMs = 0;
+unsigned long settlePumpOnMs = 0;
+unsigned long settleStopCount = 0;
+
 // Command buffer
-char cmdBuffer[32];
+char cmdBuffer[128];                // SETTABLE carries the whole coin table
 uint8_t cmdIndex = 0;
+bool cmdOverflow = false;           // line longer than cmdBuffer, drop it whole
+
+// ---------------- DISPENSE JOURNAL ----------------
+// One record per dispense, kept in RAM and mirrored to EEPROM after the
+// legacy calibration block (0..15). Dumped in binary with JOURNAL.
+#define JOURNAL_SIZE        8
+#define JOURNAL_EEPROM_ADDR 64
+#define JOURNAL_MAGIC       0x4A    // 'J'
+#define OVERSHOOT_SETTLE_MS 300     // pulses counted after valve close
+#define FLOW_WINDOW_MS      250     // flow rate sampling window
+
+#define END_NORMAL 0
+#define END_EARLY  1                // cup removed or STOP command
+
+struct JournalRecord {              // 16 bytes
+  uint16_t targetML;
+  uint16_t pulses;                  // total pulses including overshoot
+  uint16_t durationDs;              // pump on time, 0.1 s units
+  uint16_t peakFlowX10;             // mL/s x10
+  uint16_t meanFlowX10;             // mL/s x10
+  int16_t  overshootPulses;         // learned overshoot used for this dispense
+  uint16_t pulsesPerLiter;          // calibration in effect
+  uint8_t  endReason;
+  uint8_t  seq;
+};
+
+struct JournalHeader {
+  uint8_t magic;
+  uint8_t head;                     // next slot to write
+  uint8_t count;
+  uint8_t seq;
+  int16_t learnedOvershoot;         // pulses, EMA of measured coast
+};
+
+JournalRecord journal[JOURNAL_SIZE];
+JournalHeader journalHdr;
+
+// Per-dispense statistics
+uint16_t dispenseTargetML = 0;
+unsigned long dispenseStartMs = 0;
+unsigned long flowWindowStartMs = 0;
+unsigned long flowWindowStartCount = 0;
+uint16_t peakFlowX10 = 0;
+
+// ---------------- PROGRESS TELEMETRY ----------------
+// While dispensing: "DP:<ml x10>,<flow mL/s x10>,<eta ms>" at up to
+// progressHz (PROGRESS_HZ:n). The rate steps down when the TX buffer has
+// not drained and back up once it is empty.
+#define PROGRESS_HZ_MIN   5
+#define PROGRESS_HZ_MAX   20
+#define PROGRESS_FRAME_MAX 24       // longest DP frame incl. CR LF
+#define DEFAULT_FLOW_X10  410       // 41 mL/s, used until the journal has data
+
+uint8_t progressHz = 10;
+uint8_t progressHzNow = 10;
+unsigned long lastProgressMs = 0;
+uint16_t flowNowX10 = 0;            // flow over the last window
+
+// ---------------- FLOW AUTO-CALIBRATION ----------------
+// Refines pulsesPerLiter from reference volumes reported with REFML:<ml>
+// (a measured reference cup, or a tank-level delta computed by the Pi).
+// The reference covers every pulse counted since the previous REFML.
+#define AUTOCAL_EEPROM_ADDR  200    // after the journal (64..197)
+#define AUTOCAL_MAGIC        0x41   // 'A'
+#define AUTOCAL_HIST_SIZE    4
+#define AUTOCAL_MIN_REF_ML   200    // smaller references are too coarse
+#define AUTOCAL_REJECT_PCT   15     // samples further off are discarded
+#define AUTOCAL_STEP_PCT     2      // max correction applied per sample
+#define AUTOCAL_MIN_SAMPLES  3
+#define AUTOCAL_MAX_SPREAD   20     // permille, needed before persisting
+#define AUTOCAL_REF_EVERY    20     // dispenses between reference requests
+
+struct AutoCalEntry {               // 6 bytes
+  uint16_t oldPPL;
+  uint16_t newPPL;
+  uint8_t  samples;
+  uint8_t  spreadPermille;
+};
+
+struct AutoCalHeader {
+  uint8_t magic;
+  uint8_t enabled;
+  uint8_t head;
+  uint8_t count;
+};
+
+AutoCalHeader autoCalHdr;
+float autoCalEstimate = 0;          // running K estimate, not yet applied
+uint16_t autoCalSpread = 0;         // mean deviation of samples, permille
+uint8_t autoCalSamples = 0;
+unsigned long refPulseAccum = 0;    // pulses since the last reference
+unsigned long refVolumeUL = 0;      // what the firmware thinks they were
+uint8_t dispensesSinceRef = 0;
+
+// ---------------- STANDALONE MODE ----------------
+// Once the Pi has sent a PING the board expects one (or any other command)
+// at least every PI_TIMEOUT_MS. If the Pi goes quiet the board keeps
+// selling water on its own, priced from the EEPROM table. Its sales wait
+// in the money outbox like any other coin until the Pi is back.
+#define PI_TIMEOUT_MS       30000UL
+#define LEGACY_PRICE_ADDR   232     // pre-config-store location
+#define PRICE_MAGIC         0x50    // 'P'
+
+struct PriceTable {                 // legacy standalone mL per P1/P5/P10
+  uint8_t  magic;
+  uint16_t ml[3];
+};
+
+bool piWatchdogArmed = false;       // set by the first PING
+bool standalone = false;
+unsigned long piSeenMs = 0;
+uint8_t piOrderMode = ORDER_BY_CREDIT;  // the Pi's order mode, back on exit
+
+// ---------------- MONEY OUTBOX ----------------
+// Every accepted coin becomes EVT:seq,coin,amount,tag,flags,age_s,epoch and
+// stays in an EEPROM ring until the Pi answers ACK:seq. Unacked events are
+// resent with exponential backoff; RESYNC resends them all at once. The
+// epoch is picked at random whenever the outbox is re-initialised (reflash,
+// bad header), so the Pi can tell a restarted seq from one it has seen.
+// Head, tail and the last seq are not stored: boot rebuilds them from the
+// records, so a coin writes only its own record, an ack only its flags byte,
+// and the header changes once per boot.
+#define OUTBOX_EEPROM_ADDR  240
+#define OUTBOX_MAGIC        0x51    // 'Q', ring state derived from the records
+#define EPOCH_NOISE_PIN     A6      // unconnected, analog-only on the Nano
+#define OUTBOX_SIZE         16
+#define OUTBOX_RETRY_MS     1000    // first retransmission
+#define OUTBOX_RETRY_MAX_MS 30000
+#define EVT_AGE_UNKNOWN     0xFFFF  // event was made before the last reboot
+
+#define EVT_STANDALONE      0x01    // sold at standalone prices
+#define EVT_CHARGING        0x02    // amount is seconds, not mL
+#define EVT_ACKED           0x80
+
+struct MoneyEvent {                 // 13 bytes
+  uint16_t seq;                     // 0 = empty slot
+  uint8_t  coin;
+  uint8_t  boot;                    // boot counter when the coin came in
+  uint16_t amount;                  // mL or seconds credited
+  uint8_t  tag;
+  uint8_t  flags;
+  uint32_t uptimeS;
+  uint8_t  check;                   // CRC low byte of every field but flags
+};
+
+struct OutboxHeader {
+  uint8_t  magic;
+  uint8_t  boot;
+  uint16_t epoch;                   // identifies this seq numbering
+};
+
+OutboxHeader outboxHdr;
+uint8_t outboxHead = 0;             // next slot to write
+uint8_t outboxCount = 0;            // oldest unacked .. head
+uint16_t outboxSeq = 0;             // last sequence number handed out
+unsigned long outboxRetryAt = 0;
+unsigned long outboxBackoffMs = OUTBOX_RETRY_MS;
+
+// ---------------- CONFIG STORE ----------------
+// All settings live in one typed record with magic, schema version, length,
+// generation and CRC-16. Each save goes to the next of CONFIG_SLOTS slots
+// so no single cell takes every write; boot picks the valid slot with the
+// newest generation. Records written by an older schema load with defaults
+// for the fields they did not have yet. The logs (journal, autocal history,
+// outbox) keep their own rings below 512.
+#define CONFIG_EEPROM_ADDR  512
+#define CONFIG_SLOT_SIZE    128
+#define CONFIG_SLOTS        4       // 512..1023
+#define CONFIG_MAGIC        0xC5
+#define CONFIG_VERSION      3
+#define CONFIG_HEADER_SIZE  8       // magic..crc, not covered by the CRC
+
+struct ConfigRecord {
+  uint8_t  magic;
+  uint8_t  version;
+  uint8_t  length;                  // sizeof(ConfigRecord) of the writer
+  uint8_t  reserved;
+  uint16_t gen;
+  uint16_t crc;                     // CRC-16/CCITT over bytes 8..length-1
+  // --- schema 1 ---
+  uint8_t  coinPulses[3];           // P1, P5, P10; still written for downgrades
+  uint8_t  autoCalEnabled;
+  float    pulsesPerLiter;
+  FlowCurve curve;
+  uint16_t priceML[3];              // standalone mL per P1/P5/P10, ditto
+  // --- schema 2 ---
+  uint8_t  coinCount;
+  CoinEntry coins[COIN_TABLE_MAX];
+  // --- schema 3 ---
+  TimingSignature signature;
+};
+
+uint8_t configSlot = CONFIG_SLOTS - 1;   // last slot written
+uint16_t configGen = 0;
 
 // ---------------- INTERRUPTS ----------------
+// Fixed budget: one micros() and millis(), a port read, a handful of
+// compares and at most one 16-bit ring store per edge; no loops, no
+// divisions. Everything statistical happens in handleCoin.
 void coinISR() {
-  // Check if coins are globally blocked
-  if (blockAllCoins) {
-    if (millis() >= coinBlockUntil) {
-      // Blocking period expired, auto-unblock
-      blockAllCoins = false;
-      coinBlockUntil = 0;
-    } else {
-      // Still in blocking period, ignore pulse
-      return;
+  unsigned long nowMicros = micros();
+  uint16_t stamp = (nowMicros >> 7) & 0x7FFF;
+
+  // Rising edge: closes the pulse the last counted falling edge opened,
+  // unless it is contact bounce inside the same 5 ms gate as below
+  if (*coinPinReg & coinPinMask) {
+    if (coinPulseOpen && nowMicros - lastCoinMicros >= 5000) {
+      coinPulseOpen = false;
+      edgeRing[edgeHead++ & (EDGE_RING_SIZE - 1)] = stamp | EDGE_RISING;
     }
+    return;
   }
-  
-  if (!coinInputEnabled) return;
 
-  unsigned long nowMicros = micros();
+  // Relay switching couples into the coin line; blank a short window
+  if (nowMicros - relayEdgeMicros < RELAY_BLANK_US) {
+    isrRelayDrops++;
+    return;
+  }
 
   // Noise pulses are <5ms apart
-  if (nowMicros - lastCoinMicros < 5000) return;
+  if (nowMicros - lastCoinMicros < 5000) {
+    isrGateDrops++;
+    return;
+  }
 
   lastCoinMicros = nowMicros;
 
@@ -88,9 +510,20 @@ void coinISR() {
   if (now - lastCoinPulseTime > COIN_DEBOUNCE_MS) {
     coinPulseCount++;
     lastCoinPulseTime = now;
+    coinPulseOpen = true;
+    edgeRing[edgeHead++ & (EDGE_RING_SIZE - 1)] = stamp;
   }
 }
 
+// Widths and periods share this; us in, 0.1 ms stored
+void timingAdd(uint32_t& sum, uint16_t& mn, uint16_t& mx, uint16_t& n, unsigned long us) {
+  uint16_t v = min(us / 100, 65535UL);
+  if (n == 0 || v < mn) mn = v;
+  if (n == 0 || v > mx) mx = v;
+  sum += v;
+  n++;
+}
+
 void flowISR() {
   flowPulseCount++;
 }
@@ -105,21 +538,21 @@ void setup() {
   pinMode(CUP_ECHO_PIN, INPUT);
   pinMode(PUMP_PIN, OUTPUT);
   pinMode(VALVE_PIN, OUTPUT);
+  digitalWrite(COIN_INHIBIT_PIN, !COIN_INHIBIT_LEVEL);
+  pinMode(COIN_INHIBIT_PIN, OUTPUT);
 
-  digitalWrite(PUMP_PIN, LOW);
-  digitalWrite(VALVE_PIN, LOW);
+  setPumpValve(false);
 
-  attachInterrupt(digitalPinToInterrupt(COIN_PIN), coinISR, FALLING);
+  coinPinReg = portInputRegister(digitalPinToPort(COIN_PIN));
+  coinPinMask = digitalPinToBitMask(COIN_PIN);
+  attachInterrupt(digitalPinToInterrupt(COIN_PIN), coinISR, CHANGE);
   attachInterrupt(digitalPinToInterrupt(FLOW_SENSOR_PIN), flowISR, RISING);
 
-  // Load calibration from EEPROM
-  EEPROM.get(0, coin1P_pulses);
-  EEPROM.get(4, coin5P_pulses);
-  EEPROM.get(8, coin10P_pulses);
-  EEPROM.get(12, pulsesPerLiter);
-
-  if (isnan(pulsesPerLiter) || pulsesPerLiter < 200 || pulsesPerLiter > 10000)
-    pulsesPerLiter = 450.0;
+  // Logs first; the config load may migrate settings out of them
+  loadJournal();
+  loadAutoCal();
+  loadOutbox();
+  loadConfig();
 
   Serial.println(F("System Ready. Insert coin or type commands."));
   Serial.print(F("Current Mode: ")); 
@@ -130,100 +563,116 @@ void setup() {
 // ---------------- LOOP ----------------
 void loop() {
   handleCoin();
+  handleCoinCal();
+  handleCoinStats();
   
-  // Only handle cup detection in WATER mode
-  if (currentMode == MODE_WATER) {
-    handleCup();
-    handleDispensing();
-  }
+  // Water runs whatever mode the coin acceptor is selling for
+  handleCup();
+  handleDispensing();
+  handleSettle();
+  if (currentMode == MODE_WATER) bindWaterTag();
   
   handleInactivity();
   
   handleSerialCommand();
+  handlePiWatchdog();
+  handleOutbox();
+  handleCoinInhibit();
 
   reportStatus();
   
-  delay(100);
+  delay(dispensing ? DISPENSE_LOOP_MS : IDLE_LOOP_MS);
 }
 
 // ---------------- COIN HANDLER ----------------
 void handleCoin() {
-  // Check if coins are blocked
-  if (blockAllCoins) {
-    if (millis() >= coinBlockUntil) {
-      // Blocking period expired, auto-unblock
-      blockAllCoins = false;
-      coinBlockUntil = 0;
-      Serial.println(F("COINS_AUTO_UNBLOCKED"));
-    } else {
-      // Still in blocking period, discard any accumulated pulses
-      coinPulseCount = 0;
-      return;
-    }
-  }
-  
-  if (!coinInputEnabled) {
-    coinPulseCount = 0;
-    return;
-  }
-
+  // Blocked coins are turned away by the acceptor (handleCoinInhibit);
+  // a train that still arrives was paid before the inhibit and counts
   if (coinPulseCount > 0 && (millis() - lastCoinPulseTime > COIN_TIMEOUT_MS)) {
-    uint8_t pulses = coinPulseCount;
-    coinPulseCount = 0;
+    CoinTiming timing;
+    uint8_t pulses = takeCoinTrain(timing);
 
-    if (pulses < 1 || pulses > 12) {
+    if (pulses < 1 || pulses > COIN_PULSES_MAX) {
       Serial.println(F("Rejected noise pulses."));
+      statsBump(coinStats[statsHead].noise);
       return;
     }
 
-    // EXACT MATCHING - only determine coin value
-    uint8_t coinValue = 0;
-    
-    if (pulses == 1) {
-      coinValue = 1;
-    } 
-    else if (pulses == 5) {
-      coinValue = 5;
+    // Calibration owns the acceptor until it is done; no credit
+    if (coinCalActive) {
+      coinCalSample(pulses, timing);
+      return;
     }
-    else if (pulses == 10) {
-      coinValue = 10;
+
+    uint8_t tamper = checkTrainTiming(pulses, timing);
+    if (tamper != TAMPER_NONE) {
+      reportTamper(tamper, pulses, timing);
+      return;
     }
-    else {
+
+    // Match the pulse train against the coin table
+    const CoinEntry* coin = findCoinByPulses(pulses);
+    if (!coin) {
       Serial.print(F("Unknown coin pattern: "));
       Serial.println(pulses);
+      statsBump(coinStats[statsHead].unknown);
+      statsBump(coinStats[statsHead].unknownHist[min(pulses, (uint8_t)STATS_HIST_BINS) - 1]);
       return;
     }
+    statsBump(coinStats[statsHead].accepted[coin - coinTable]);
+    if (coinInhibitReasons) statsBump(coinStats[statsHead].inflight);
+    uint8_t coinValue = coin->peso;
+    uint16_t addedSeconds = coin->seconds;
+
+    // Without the Pi the board sells at its own prices
+    uint16_t addedML = standalone ? coin->standaloneML : coin->ml;
+
+    // The money event goes out (and into the outbox) before anything else
+    uint8_t flags = standalone ? EVT_STANDALONE : 0;
+    if (currentMode == MODE_CHARGING) flags |= EVT_CHARGING;
+    outboxPush(coinValue, currentMode == MODE_CHARGING ? addedSeconds : addedML, flags);
 
     // Send ONLY ONE clean message with coin value
     // Format: "COIN:1" or "COIN:5" or "COIN:10"
     Serial.print(F("COIN:"));
     Serial.println(coinValue);
-    
+
     // CRITICAL FIX: Update credit based on mode
-    if (currentMode == MODE_WATER) {
+    Wallet* w = findWallet(activeTag, true);
+    if (currentMode == MODE_WATER && activeTag != waterTag) {
+      // Dispenser busy with another customer; park it in this tag's wallet
+      w->creditML += addedML;
+      bindWaterTag();
+      Serial.print(F("WATER Credit parked: tag="));
+      Serial.print(activeTag);
+      Serial.print(F(", "));
+      Serial.print(w->creditML);
+      Serial.println(F(" mL"));
+    } else if (currentMode == MODE_WATER) {
       // Add water credit based on coin value
-      // Map coin values to mL: P1=50mL, P5=250mL, P10=500mL
-      if (coinValue == 1) {
-        creditML += 50;
-      } else if (coinValue == 5) {
-        creditML += 250;
-      } else if (coinValue == 10) {
-        creditML += 500;
+      if (orderMode == ORDER_BY_COIN) {
+        // Each coin is its own cup
+        creditML += addedML;
+        enqueueOrder(addedML);
+      } else if (dispensing || settlePending) {
+        // Current cup keeps its amount; this one is served right after
+        pendingCreditML += addedML;
+        Serial.print(F("WATER Credit queued: "));
+        Serial.print(pendingCreditML);
+        Serial.println(F(" mL"));
+      } else {
+        creditML += addedML;
+        Serial.print(F("WATER Credit updated: "));
+        Serial.print(creditML);
+        Serial.println(F(" mL"));
       }
-      Serial.print(F("WATER Credit updated: "));
-      Serial.print(creditML);
-      Serial.println(F(" mL"));
     } else if (currentMode == MODE_CHARGING) {
       // Add charging credit
-      if (coinValue == 1) {
-        chargeSeconds += 300;  // 5 minutes for P1
-      } else if (coinValue == 5) {
-        chargeSeconds += 1800; // 30 minutes for P5
-      } else if (coinValue == 10) {
-        chargeSeconds += 3600; // 60 minutes for P10
-      }
-      Serial.print(F("CHARGING Credit updated: "));
-      Serial.print(chargeSeconds);
+      w->chargeSeconds += addedSeconds;
+      Serial.print(F("CHARGING Credit updated: tag="));
+      Serial.print(activeTag);
+      Serial.print(F(", "));
+      Serial.print(w->chargeSeconds);
       Serial.println(F(" seconds"));
     }
     
@@ -234,22 +683,92 @@ void handleCoin() {
   }
 }
 
+// Hands the finished pulse train to the loop and starts a fresh one
+uint8_t takeCoinTrain(CoinTiming& timing) {
+  noInterrupts();
+  uint8_t pulses = coinPulseCount;
+  coinPulseCount = 0;
+  coinPulseOpen = false;
+  uint8_t head = edgeHead;
+  interrupts();
+
+  // The ISR writes past head only, so the train's edges are stable now
+  uint8_t n = head - edgeTail;
+  if (n > EDGE_RING_SIZE) edgeTail = head - EDGE_RING_SIZE;
+
+  memset(&timing, 0, sizeof(timing));
+  bool haveFall = false;
+  uint16_t lastFall = 0;
+  for (uint8_t i = edgeTail; i != head; i++) {
+    uint16_t e = edgeRing[i & (EDGE_RING_SIZE - 1)];
+    uint16_t t = e & 0x7FFF;
+    if (e & EDGE_RISING) {
+      if (haveFall) {
+        timingAdd(timing.widthSum, timing.widthMin, timing.widthMax, timing.widthN,
+                  (unsigned long)((t - lastFall) & 0x7FFF) << 7);
+      }
+    } else {
+      if (haveFall) {
+        timingAdd(timing.periodSum, timing.periodMin, timing.periodMax, timing.periodN,
+                  (unsigned long)((t - lastFall) & 0x7FFF) << 7);
+      }
+      haveFall = true;
+      lastFall = t;
+    }
+  }
+  edgeTail = head;
+  return pulses;
+}
+
+void dropCoinTrain() {
+  CoinTiming timing;
+  takeCoinTrain(timing);
+}
 
 // ---------------- CUP HANDLER ----------------
 // In arduinocode.ino, update the handleCup() function:
 void handleCup() {
-  // Only detect cup if in WATER mode with credit
-  if (currentMode != MODE_WATER) {
-    return;  // Don't check cup if not in WATER mode
+  if (dispensing) {
+    // Stop early if the cup stays away longer than the grace period
+    static unsigned long lastCupCheck = 0;
+    if (millis() - lastCupCheck < CUP_CHECK_MS) return;
+    lastCupCheck = millis();
+
+    if (detectCup()) {
+      if (cupRemovedFlag) Serial.println(F("CUP_REPLACED"));
+      cupRemovedFlag = false;
+    } else if (!cupRemovedFlag) {
+      cupRemovedFlag = true;
+      cupRemovedTime = millis();
+      Serial.println(F("CUP_REMOVED"));
+    } else if (millis() - cupRemovedTime > CUP_REMOVED_GRACE_MS) {
+      stopDispenseEarly();
+    }
+    return;
   }
-  
-  if (creditML <= 0) {
+
+  if ((creditML <= 0 && !awaitCupClear) || settlePending) {
     // Optional debug message
     // Serial.println(F("DEBUG: Cup detected but no credit"));
     return;
   }
+
+  bool cup = detectCup();
+  if (awaitCupClear) {
+    // Queued credit belongs to the next customer's cup
+    if (!cup) {
+      awaitCupClear = false;
+      if (orderAwaitRemoval) orderCupRemoved();
+    }
+    return;
+  }
+
+  if (orderCount > 0) {
+    if (cup) startOrder();
+    return;
+  }
   
-  if (detectCup() && creditML > 0 && !dispensing) {
+  if (cup && creditML > 0 && !dispensing) {
     Serial.println(F("Cup detected. Starting dispense..."));
     startDispense(creditML);
   }
@@ -258,33 +777,39 @@ void handleCup() {
 
 // ---------------- DISaPENSING ----------------
 void startDispense(uint16_t ml) {
-  // Only allow dispensing in WATER mode
-  if (currentMode != MODE_WATER) {
-    Serial.println(F("ERROR: Cannot dispense in CHARGING mode"));
-    return;
-  }
-
-  coinInputEnabled = false;
-  detachInterrupt(digitalPinToInterrupt(COIN_PIN));
-  coinPulseCount = 0;
+  // Pump starts right away; no settling delay between back-to-back orders
 
-  // Accurate target pulses (pure formula)
-  targetPulses = (unsigned long)((ml / 1000.0) * pulsesPerLiter);
+  // Target volume, less the coast the pump adds after closing
+  targetUL = (unsigned long)ml * 1000UL;
+  if (journalHdr.learnedOvershoot > 0) {
+    unsigned long coastUL = pulsesToUL(journalHdr.learnedOvershoot, flowFreqX10);
+    if (targetUL > coastUL) targetUL -= coastUL;
+  }
   startFlowCount = flowPulseCount;
+  lastIntegrateCount = startFlowCount;
+  dispensedUL = 0;
 
-  // Flow stabilization for horizontal sensor
-  delay(200);
-
-  digitalWrite(PUMP_PIN, HIGH);
-  digitalWrite(VALVE_PIN, HIGH);
+  setPumpValve(true);
   dispensing = true;
-  
-  // Calculate exact animation time based on 41.70 mL/second flow rate
-  float baseFlowRateMLperSecond = 41;
-  float estimatedSeconds = ml / baseFlowRateMLperSecond;
-   // Add buffer for system delay
-  
-  uint16_t animationSeconds = (uint16_t)(estimatedSeconds + 0.5f); 
+  cupRemovedFlag = false;
+
+  dispenseTargetML = ml;
+  dispenseStartMs = millis();
+  flowWindowStartMs = dispenseStartMs;
+  flowWindowStartCount = startFlowCount;
+  peakFlowX10 = 0;
+  flowNowX10 = 0;
+  progressHzNow = progressHz;
+  lastProgressMs = 0;
+
+  // Initial animation estimate from the last journaled mean flow; the
+  // DP frames correct it while pouring
+  uint16_t baseFlowX10 = DEFAULT_FLOW_X10;
+  if (journalHdr.count > 0) {
+    uint16_t lastMean = journal[(journalHdr.head + JOURNAL_SIZE - 1) % JOURNAL_SIZE].meanFlowX10;
+    if (lastMean > 0) baseFlowX10 = lastMean;
+  }
+  uint16_t animationSeconds = (uint16_t)(((unsigned long)ml * 10UL + baseFlowX10 / 2) / baseFlowX10);
   
   // Send clean animation command FIRST, then debug messages
   Serial.print(F("ANIMATION_START:"));
@@ -292,14 +817,10 @@ void startDispense(uint16_t ml) {
   Serial.print(F(","));
   Serial.println(animationSeconds);
   
-  // Small delay to ensure the animation command is sent completely
-  delay(50);
-  
-  // Then send debug messages separately
   Serial.print(F("DEBUG: Starting dispense - ML: "));
   Serial.print(ml);
   Serial.print(F(", Flow Rate: "));
-  Serial.print(baseFlowRateMLperSecond);
+  Serial.print(baseFlowX10 / 10.0, 1);
   Serial.print(F(" mL/s, Estimated Time: "));
   Serial.println(animationSeconds);
 }
@@ -307,62 +828,1277 @@ void startDispense(uint16_t ml) {
 void handleDispensing() {
   if (!dispensing) return;
 
-  unsigned long dispensedPulses = flowPulseCount - startFlowCount;
-  
-  // Show dispensing progress
-  static unsigned long lastProgress = 0;
-  if (millis() - lastProgress > 1000) {
-    float progressML = pulsesToML(dispensedPulses);
-    Serial.print(F("Dispensing progress: "));
-    Serial.print(progressML, 1);
-    Serial.print(F("mL / "));
-    Serial.print(creditML);
-    Serial.println(F("mL"));
-    lastProgress = millis();
+  // Integrate volume with the K-factor for the current flow rate
+  unsigned long count = flowPulseCount;
+  dispensedUL += pulsesToUL(count - lastIntegrateCount, flowFreqX10);
+  lastIntegrateCount = count;
+
+  // Measure pulse frequency and peak flow rate over short windows
+  unsigned long windowMs = millis() - flowWindowStartMs;
+  if (windowMs >= FLOW_WINDOW_MS) {
+    unsigned long windowPulses = count - flowWindowStartCount;
+    flowFreqX10 = (uint16_t)min(windowPulses * 10000UL / windowMs, 65535UL);
+    flowNowX10 = flowRateX10(windowPulses, windowMs);
+    if (flowNowX10 > peakFlowX10) peakFlowX10 = flowNowX10;
+    flowWindowStartMs = millis();
+    flowWindowStartCount = count;
   }
   
-  if (dispensedPulses >= targetPulses) {
+  if (dispensedUL >= targetUL) {
     stopDispense();
+    return;
   }
+
+  sendProgressFrame(false);
+}
+
+void sendProgressFrame(bool force) {
+  if (!force && millis() - lastProgressMs < 1000UL / progressHzNow) return;
+
+  // Adapt to link load: skip and slow down while the TX buffer is busy
+  int txFree = Serial.availableForWrite();
+  if (!force && txFree < PROGRESS_FRAME_MAX) {
+    if (progressHzNow > PROGRESS_HZ_MIN) progressHzNow--;
+    return;
+  }
+  if (txFree >= SERIAL_TX_BUFFER_SIZE - 1 && progressHzNow < progressHz) progressHzNow++;
+  lastProgressMs = millis();
+
+  unsigned long remainingUL = targetUL > dispensedUL ? targetUL - dispensedUL : 0;
+  unsigned long etaMs = flowNowX10 ? min(remainingUL * 10UL / flowNowX10, 65535UL) : 65535UL;
+
+  Serial.print(F("DP:"));
+  Serial.print(dispensedUL / 100);
+  Serial.print(F(","));
+  Serial.print(flowNowX10);
+  Serial.print(F(","));
+  Serial.println(etaMs);
+}
+
+void setProgressRate(int hz) {
+  if (hz < PROGRESS_HZ_MIN || hz > PROGRESS_HZ_MAX) {
+    Serial.println(F("ERROR: PROGRESS_HZ must be 5-20"));
+    return;
+  }
+  progressHz = hz;
+  progressHzNow = hz;
+  Serial.print(F("PROGRESS_HZ:"));
+  Serial.println(progressHz);
 }
 
 void stopDispense() {
-  digitalWrite(PUMP_PIN, LOW);
-  digitalWrite(VALVE_PIN, LOW);
+  setPumpValve(false);
   dispensing = false;
+  unsigned long pumpOnMs = millis() - dispenseStartMs;
+  unsigned long stopCount = flowPulseCount;
+  flowNowX10 = 0;
+  sendProgressFrame(true);
 
-  float dispensedML = pulsesToML(flowPulseCount - startFlowCount);
+  float dispensedML = dispensedUL / 1000.0;
   Serial.print(F("Dispensing complete. Total: "));
   Serial.print(dispensedML, 1);
   Serial.println(F(" ml"));
 
-  // Reset water credit after dispensing
-  creditML = 0;
+  // Reset water credit after dispensing; queued orders keep theirs
+  creditML = creditML > dispenseTargetML ? creditML - dispenseTargetML : 0;
 
-  delay(300); // noise-clearing window
+  if (orderActive) finishOrder(pumpOnMs);
 
-  // Re-enable coin input
-  coinPulseCount = 0;
-  lastCoinMicros = micros();
-  coinInputEnabled = true;
-  attachInterrupt(digitalPinToInterrupt(COIN_PIN), coinISR, FALLING);
+  beginSettle(END_NORMAL, pumpOnMs, stopCount);
+  lastActivity = millis();
+}
+
+void stopDispenseEarly() {
+  setPumpValve(false);
+  dispensing = false;
+  cupRemovedFlag = false;
+  unsigned long pumpOnMs = millis() - dispenseStartMs;
+  unsigned long stopCount = flowPulseCount;
+  flowNowX10 = 0;
+  sendProgressFrame(true);
 
+  float dispensedML = dispensedUL / 1000.0;
+  float remaining = creditML - dispensedML;
+  if (remaining < 0) remaining = 0;
+
+  Serial.print(F("Dispensing stopped early. Total: "));
+  Serial.print(dispensedML, 1);
+  Serial.println(F(" ml"));
+  Serial.print(F("CREDIT_LEFT:"));
+  Serial.println((uint16_t)remaining);
+
+  // Keep what was not poured for the next cup
+  creditML = (uint16_t)remaining;
+
+  if (orderActive) {
+    // The unpoured part of the order stays at the head of the queue
+    uint16_t poured = (uint16_t)min(dispensedML, (float)orderML[orderHead]);
+    orderML[orderHead] -= poured;
+    orderActive = false;
+    Serial.print(F("ORDER_PARTIAL:"));
+    Serial.print(orderSeq);
+    Serial.print(F(","));
+    Serial.println(orderML[orderHead]);
+    if (orderML[orderHead] == 0) popOrder();
+  }
+
+  beginSettle(END_EARLY, pumpOnMs, stopCount);
   lastActivity = millis();
 }
 
+// ---------------- ORDERS ----------------
+static_assert(ORDER_QUEUE_SIZE > 1, "a full queue must have a waiting order to fold into");
+
+void enqueueOrder(uint16_t ml) {
+  if (orderCount >= ORDER_QUEUE_SIZE) {
+    // Queue full: fold into the last order (never the one pouring)
+    // rather than lose paid credit
+    orderML[(orderHead + orderCount - 1) % ORDER_QUEUE_SIZE] += ml;
+    return;
+  }
+  if (orderCount == 0) orderReadyMs = millis();
+  orderML[(orderHead + orderCount) % ORDER_QUEUE_SIZE] = ml;
+  orderCount++;
+  Serial.print(F("ORDER_QUEUED:"));
+  Serial.print(orderCount);
+  Serial.print(F(","));
+  Serial.println(ml);
+}
+
+void popOrder() {
+  orderHead = (orderHead + 1) % ORDER_QUEUE_SIZE;
+  orderCount--;
+}
+
+// ORDER:250,250,500 - queued orders must be covered by credit. A plain
+// CREDIT pour still counts its cup in creditML until it stops, so that
+// cup is taken off first.
+void queueOrders(char* list) {
+  unsigned long total = (dispensing && !orderActive) ? dispenseTargetML : 0;
+  for (uint8_t i = 0; i < orderCount; i++) total += orderML[(orderHead + i) % ORDER_QUEUE_SIZE];
+
+  uint16_t parsed[ORDER_QUEUE_SIZE];
+  uint8_t n = 0;
+  for (char* tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+    int ml = atoi(tok);
+    if (ml <= 0 || ml > ORDER_MAX_ML || n + orderCount >= ORDER_QUEUE_SIZE) {
+      Serial.println(F("ERROR: Invalid or too many orders"));
+      return;
+    }
+    parsed[n++] = ml;
+    total += ml;
+  }
+  if (n == 0 || total > creditML + pendingCreditML) {
+    Serial.println(F("ERROR: Orders exceed credit"));
+    return;
+  }
+
+  // Orders own their credit from now on
+  creditML += pendingCreditML;
+  pendingCreditML = 0;
+  for (uint8_t i = 0; i < n; i++) enqueueOrder(parsed[i]);
+}
+
+void startOrder() {
+  uint16_t ml = min(orderML[orderHead], creditML);
+  if (ml == 0) {
+    // No credit left behind this order; tell the Pi instead of dropping it quietly
+    Serial.print(F("ORDER_ERROR:NO_CREDIT,"));
+    Serial.println(orderML[orderHead]);
+    popOrder();
+    return;
+  }
+  orderSeq++;
+  orderActive = true;
+  orderPourStartMs = millis();
+  Serial.print(F("ORDER_START:"));
+  Serial.print(orderSeq);
+  Serial.print(F(","));
+  Serial.println(ml);
+  startDispense(ml);
+}
+
+void finishOrder(unsigned long pumpOnMs) {
+  orderActive = false;
+  orderDoneML = orderML[orderHead];
+  orderPourMs = pumpOnMs;
+  popOrder();
+  orderAwaitRemoval = true;
+  awaitCupClear = true;
+}
+
+// Cup of the finished order taken away: report its timing, next is ready
+void orderCupRemoved() {
+  unsigned long now = millis();
+  Serial.print(F("ORDER_DONE:"));
+  Serial.print(orderSeq);
+  Serial.print(F(","));
+  Serial.print(orderDoneML);
+  Serial.print(F(","));
+  Serial.print(orderPourStartMs - orderReadyMs);   // waiting for the cup
+  Serial.print(F(","));
+  Serial.print(orderPourMs);                      // pouring
+  Serial.print(F(","));
+  Serial.println(now - orderReadyMs);             // whole cycle
+  orderAwaitRemoval = false;
+  orderReadyMs = now;
+}
+
+void clearOrders() {
+  orderCount = 0;
+  orderActive = false;
+  orderAwaitRemoval = false;
+}
+
+void showOrders() {
+  Serial.print(F("ORDERS:"));
+  Serial.print(orderMode == ORDER_BY_COIN ? "COIN" : "CREDIT");
+  for (uint8_t i = 0; i < orderCount; i++) {
+    Serial.print(i == 0 ? ":" : ",");
+    Serial.print(orderML[(orderHead + i) % ORDER_QUEUE_SIZE]);
+  }
+  Serial.println();
+}
+
+// Pump and valve always switch together; each edge opens a coin blanking window
+void setPumpValve(bool on) {
+  relayEdgeMicros = micros();
+  digitalWrite(PUMP_PIN, on ? HIGH : LOW);
+  digitalWrite(VALVE_PIN, on ? HIGH : LOW);
+}
+
+void beginSettle(uint8_t endReason, unsigned long pumpOnMs, unsigned long stopCount) {
+  settlePending = true;
+  settleEndReason = endReason;
+  settleStartMs = millis();
+  settlePumpOnMs = pumpOnMs;
+  settleStopCount = stopCount;
+}
+
+// Journals the finished dispense once the pump has coasted to a stop,
+// then releases any credit paid in the meantime
+void handleSettle() {
+  if (!settlePending || millis() - settleStartMs < OVERSHOOT_SETTLE_MS) return;
+  settlePending = false;
+  journalAppend(settleEndReason, settlePumpOnMs, settleStopCount);
+
+  if (pendingCreditML > 0) {
+    creditML += pendingCreditML;
+    pendingCreditML = 0;
+    awaitCupClear = (settleEndReason == END_NORMAL);
+    Serial.print(F("PENDING_CREDIT_APPLIED:"));
+    Serial.println(creditML);
+  }
+}
+
+// ---------------- JOURNAL ----------------
+void loadJournal() {
+  EEPROM.get(JOURNAL_EEPROM_ADDR, journalHdr);
+  if (journalHdr.magic != JOURNAL_MAGIC || journalHdr.head >= JOURNAL_SIZE ||
+      journalHdr.count > JOURNAL_SIZE) {
+    journalHdr.magic = JOURNAL_MAGIC;
+    journalHdr.head = 0;
+    journalHdr.count = 0;
+    journalHdr.seq = 0;
+    journalHdr.learnedOvershoot = 0;
+    EEPROM.put(JOURNAL_EEPROM_ADDR, journalHdr);
+  }
+  for (uint8_t i = 0; i < JOURNAL_SIZE; i++) {
+    EEPROM.get(JOURNAL_EEPROM_ADDR + sizeof(JournalHeader) + i * sizeof(JournalRecord), journal[i]);
+  }
+}
+
+// Called once the pump has coasted to a stop. stopCount is the flow count
+// at the moment the valve closed; anything after it is overshoot.
+void journalAppend(uint8_t endReason, unsigned long pumpOnMs, unsigned long stopCount) {
+  unsigned long pulses = flowPulseCount - startFlowCount;
+  int16_t coast = (int16_t)min(flowPulseCount - stopCount, 1000UL);
+
+  JournalRecord& r = journal[journalHdr.head];
+  r.targetML = dispenseTargetML;
+  r.pulses = (uint16_t)min(pulses, 65535UL);
+  r.durationDs = (uint16_t)min(pumpOnMs / 100, 65535UL);
+  r.peakFlowX10 = peakFlowX10;
+  r.meanFlowX10 = pumpOnMs ? (uint16_t)min(dispensedUL * 10UL / pumpOnMs, 65535UL) : 0;
+  r.overshootPulses = journalHdr.learnedOvershoot;
+  r.pulsesPerLiter = (uint16_t)pulsesPerLiter;
+  r.endReason = endReason;
+  r.seq = journalHdr.seq++;
+
+  // Only normal stops say anything about how far the pump coasts
+  if (endReason == END_NORMAL) {
+    journalHdr.learnedOvershoot += (coast - journalHdr.learnedOvershoot) / 4;
+  }
+  autoCalCountDispense(pulses, dispensedUL + pulsesToUL(coast, flowFreqX10));
+
+  EEPROM.put(JOURNAL_EEPROM_ADDR + sizeof(JournalHeader) + journalHdr.head * sizeof(JournalRecord), r);
+  journalHdr.head = (journalHdr.head + 1) % JOURNAL_SIZE;
+  if (journalHdr.count < JOURNAL_SIZE) journalHdr.count++;
+  EEPROM.put(JOURNAL_EEPROM_ADDR, journalHdr);
+}
+
+// Binary dump: "JOURNAL_BIN:<n>" line, then n bytes, then newline.
+// Payload is count, record size, records oldest first, XOR checksum.
+void dumpJournal() {
+  uint8_t n = 2 + journalHdr.count * sizeof(JournalRecord) + 1;
+  Serial.print(F("JOURNAL_BIN:"));
+  Serial.println(n);
+
+  uint8_t sum = journalHdr.count ^ sizeof(JournalRecord);
+  Serial.write(journalHdr.count);
+  Serial.write((uint8_t)sizeof(JournalRecord));
+  uint8_t idx = (journalHdr.head + JOURNAL_SIZE - journalHdr.count) % JOURNAL_SIZE;
+  for (uint8_t i = 0; i < journalHdr.count; i++) {
+    const uint8_t* p = (const uint8_t*)&journal[idx];
+    for (uint8_t b = 0; b < sizeof(JournalRecord); b++) sum ^= p[b];
+    Serial.write(p, sizeof(JournalRecord));
+    idx = (idx + 1) % JOURNAL_SIZE;
+  }
+  Serial.write(sum);
+  Serial.println();
+}
+
+// ---------------- AUTO-CALIBRATION ----------------
+void loadAutoCal() {
+  EEPROM.get(AUTOCAL_EEPROM_ADDR, autoCalHdr);
+  if (autoCalHdr.magic != AUTOCAL_MAGIC || autoCalHdr.head >= AUTOCAL_HIST_SIZE ||
+      autoCalHdr.count > AUTOCAL_HIST_SIZE) {
+    autoCalHdr.magic = AUTOCAL_MAGIC;
+    autoCalHdr.enabled = 0;
+    autoCalHdr.head = 0;
+    autoCalHdr.count = 0;
+    EEPROM.put(AUTOCAL_EEPROM_ADDR, autoCalHdr);
+  }
+  autoCalReset();
+}
+
+void autoCalReset() {
+  autoCalEstimate = pulsesPerLiter;
+  autoCalSpread = 0;
+  autoCalSamples = 0;
+  refPulseAccum = 0;
+  refVolumeUL = 0;
+  dispensesSinceRef = 0;
+}
+
+void autoCalCountDispense(unsigned long pulses, unsigned long volumeUL) {
+  if (!autoCalHdr.enabled) return;
+  refPulseAccum += pulses;
+  refVolumeUL += volumeUL;
+  if (++dispensesSinceRef >= AUTOCAL_REF_EVERY) {
+    Serial.print(F("AUTOCAL_REF_REQUEST:"));
+    Serial.println(refPulseAccum);
+    dispensesSinceRef = 0;
+  }
+}
+
+// One reference measurement: refPulseAccum pulses produced measuredML.
+// The curve shape is kept; only its overall scale (pulsesPerLiter) moves.
+void autoCalReference(uint16_t measuredML) {
+  if (!autoCalHdr.enabled) {
+    Serial.println(F("ERROR: AUTOCAL is OFF"));
+    return;
+  }
+  if (measuredML < AUTOCAL_MIN_REF_ML || refVolumeUL == 0) {
+    Serial.println(F("AUTOCAL_SKIP: reference too small"));
+    refPulseAccum = 0;
+    refVolumeUL = 0;
+    return;
+  }
+
+  float observed = pulsesPerLiter * refVolumeUL / (measuredML * 1000.0);
+  refPulseAccum = 0;
+  refVolumeUL = 0;
+  dispensesSinceRef = 0;
+
+  float dev = (observed - autoCalEstimate) / autoCalEstimate;
+  if (fabs(dev) * 100 > AUTOCAL_REJECT_PCT) {
+    Serial.print(F("AUTOCAL_REJECT:"));
+    Serial.println(observed, 1);
+    return;
+  }
+
+  // Bounded step toward the observation, then EMA of the deviation
+  float step = constrain(dev, -AUTOCAL_STEP_PCT / 100.0, AUTOCAL_STEP_PCT / 100.0);
+  autoCalEstimate *= 1.0 + step / 2;
+  uint16_t devPermille = (uint16_t)min(fabs(dev) * 1000.0, 255.0);
+  autoCalSpread = autoCalSamples == 0 ? devPermille : (autoCalSpread * 3 + devPermille) / 4;
+  if (autoCalSamples < 255) autoCalSamples++;
+
+  Serial.print(F("AUTOCAL_SAMPLE:"));
+  Serial.print(observed, 1);
+  Serial.print(F(","));
+  Serial.print(autoCalEstimate, 1);
+  Serial.print(F(","));
+  Serial.println(autoCalSpread);
+
+  // Persist only once the estimate is stable
+  if (autoCalSamples >= AUTOCAL_MIN_SAMPLES && autoCalSpread <= AUTOCAL_MAX_SPREAD &&
+      autoCalEstimate >= PPL_MIN && autoCalEstimate <= PPL_MAX &&
+      fabs(autoCalEstimate - pulsesPerLiter) >= 1.0) {
+    AutoCalEntry e;
+    e.oldPPL = (uint16_t)pulsesPerLiter;
+    e.newPPL = (uint16_t)autoCalEstimate;
+    e.samples = autoCalSamples;
+    e.spreadPermille = (uint8_t)autoCalSpread;
+    EEPROM.put(AUTOCAL_EEPROM_ADDR + sizeof(AutoCalHeader) + autoCalHdr.head * sizeof(AutoCalEntry), e);
+    autoCalHdr.head = (autoCalHdr.head + 1) % AUTOCAL_HIST_SIZE;
+    if (autoCalHdr.count < AUTOCAL_HIST_SIZE) autoCalHdr.count++;
+    EEPROM.put(AUTOCAL_EEPROM_ADDR, autoCalHdr);
+
+    pulsesPerLiter = autoCalEstimate;
+    saveConfig();
+    Serial.print(F("AUTOCAL_APPLIED:"));
+    Serial.println(pulsesPerLiter, 1);
+    autoCalSamples = 0;
+  }
+}
+
+void setAutoCal(bool on) {
+  autoCalHdr.enabled = on ? 1 : 0;
+  saveConfig();
+  autoCalReset();
+  Serial.print(F("AUTOCAL:"));
+  Serial.println(on ? "ON" : "OFF");
+}
+
+void showAutoCalHistory() {
+  Serial.print(F("CALHIST:"));
+  Serial.println(autoCalHdr.count);
+  uint8_t idx = (autoCalHdr.head + AUTOCAL_HIST_SIZE - autoCalHdr.count) % AUTOCAL_HIST_SIZE;
+  for (uint8_t i = 0; i < autoCalHdr.count; i++) {
+    AutoCalEntry e;
+    EEPROM.get(AUTOCAL_EEPROM_ADDR + sizeof(AutoCalHeader) + idx * sizeof(AutoCalEntry), e);
+    Serial.print(F("CALHIST_ENTRY:"));
+    Serial.print(e.oldPPL);
+    Serial.print(F(","));
+    Serial.print(e.newPPL);
+    Serial.print(F(","));
+    Serial.print(e.samples);
+    Serial.print(F(","));
+    Serial.println(e.spreadPermille);
+    idx = (idx + 1) % AUTOCAL_HIST_SIZE;
+  }
+}
+
+// ---------------- STANDALONE ----------------
+void handlePiWatchdog() {
+  if (!standalone && piWatchdogArmed && millis() - piSeenMs > PI_TIMEOUT_MS) {
+    enterStandalone();
+  }
+}
+
+// Called for every command line: the Pi is talking to us
+void piSeen() {
+  piSeenMs = millis();
+  if (!standalone) return;
+
+  standalone = false;
+  orderMode = piOrderMode;
+  Serial.print(F("STANDALONE:OFF,"));
+  Serial.println(outboxCount);
+  outboxResync();
+}
+
+void enterStandalone() {
+  standalone = true;
+  Serial.println(F("STANDALONE:ON"));
+
+  // Charging sessions are run by the Pi; water is all we can sell alone
+  if (currentMode != MODE_WATER) setMode(MODE_WATER);
+  piOrderMode = orderMode;
+  orderMode = ORDER_BY_CREDIT;
+}
+
+// SAPRICE:<peso>:<ml> sets the standalone volume for one coin table row
+void setStandalonePrice(char* arg) {
+  uint8_t coinValue = atoi(arg);
+  char* sep = strchr(arg, ':');
+  int ml = sep ? atoi(sep + 1) : 0;
+  CoinEntry* e = findCoinByPeso(coinValue);
+
+  if (!e || ml <= 0 || ml > ORDER_MAX_ML) {
+    Serial.println(F("Invalid price. Use: SAPRICE:<peso>:<ml>"));
+    return;
+  }
+  e->standaloneML = ml;
+  saveConfig();
+  showPrices();
+}
+
+void showPrices() {
+  Serial.print(F("SAPRICE:"));
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    if (i > 0) Serial.print(',');
+    Serial.print(coinTable[i].peso);
+    Serial.print('=');
+    Serial.print(coinTable[i].standaloneML);
+  }
+  Serial.println();
+}
+
+// ---------------- OUTBOX ----------------
+int outboxAddr(uint8_t idx) {
+  return OUTBOX_EEPROM_ADDR + sizeof(OutboxHeader) + idx * sizeof(MoneyEvent);
+}
+
+uint8_t outboxTail() {
+  return (outboxHead + OUTBOX_SIZE - outboxCount) % OUTBOX_SIZE;
+}
+
+uint16_t nextOutboxSeq(uint16_t seq) {
+  return seq == 0xFFFF ? 1 : seq + 1;   // 0 marks an empty slot
+}
+
+uint8_t moneyEventCheck(const MoneyEvent& e) {
+  const uint8_t* p = (const uint8_t*)&e;
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < offsetof(MoneyEvent, check); i++) {
+    if (i != offsetof(MoneyEvent, flags)) crc = crc16Update(crc, p[i]);
+  }
+  return crc & 0xFF;
+}
+
+// A slot counts only if it holds a whole record; a torn write reads as empty
+bool readMoneyEvent(uint8_t idx, MoneyEvent& e) {
+  EEPROM.get(outboxAddr(idx), e);
+  return e.seq != 0 && e.check == moneyEventCheck(e);
+}
+
+void loadOutbox() {
+  EEPROM.get(OUTBOX_EEPROM_ADDR, outboxHdr);
+  if (outboxHdr.magic != OUTBOX_MAGIC) {
+    outboxHdr.magic = OUTBOX_MAGIC;
+    outboxHdr.boot = 0;
+    outboxHdr.epoch = newOutboxEpoch(outboxHdr.epoch);
+    MoneyEvent empty = {};
+    for (uint8_t i = 0; i < OUTBOX_SIZE; i++) EEPROM.put(outboxAddr(i), empty);
+  }
+  outboxHdr.boot++;                 // tells this boot's uptime apart from older ones
+  EEPROM.put(OUTBOX_EEPROM_ADDR, outboxHdr);
+
+  // The newest record is the one its neighbour does not follow on from
+  outboxHead = 0;
+  outboxCount = 0;
+  outboxSeq = 0;
+  MoneyEvent e, next;
+  for (uint8_t i = 0; i < OUTBOX_SIZE; i++) {
+    if (!readMoneyEvent(i, e)) continue;
+    uint8_t n = (i + 1) % OUTBOX_SIZE;
+    if (readMoneyEvent(n, next) && next.seq == nextOutboxSeq(e.seq)) continue;
+    outboxHead = n;
+    outboxSeq = e.seq;
+    break;
+  }
+
+  // Walk back through the unbroken run of seqs to the oldest unacked one
+  uint16_t want = outboxSeq;
+  uint8_t idx = outboxHead;
+  for (uint8_t n = 1; want != 0 && n <= OUTBOX_SIZE; n++) {
+    idx = (idx + OUTBOX_SIZE - 1) % OUTBOX_SIZE;
+    if (!readMoneyEvent(idx, e) || e.seq != want) break;
+    if (!(e.flags & EVT_ACKED)) outboxCount = n;
+    want = want == 1 ? 0xFFFF : want - 1;
+  }
+
+  // Whatever survived the reset goes out once the loop is running
+  outboxRetryAt = 0;
+  outboxBackoffMs = OUTBOX_RETRY_MS;
+}
+
+// Whatever was in EEPROM, the boot time and the low bits of a floating pin
+uint16_t newOutboxEpoch(uint16_t old) {
+  uint16_t e = old ^ (uint16_t)micros();
+  for (uint8_t i = 0; i < 16; i++) {
+    e = (e << 1 | e >> 15) ^ analogRead(EPOCH_NOISE_PIN);
+  }
+  return e ? e : 1;
+}
+
+void outboxPush(uint8_t coinValue, uint16_t amount, uint8_t flags) {
+  if (outboxCount >= OUTBOX_SIZE) {
+    // Only reachable before the Pi has spoken the acked protocol (coins
+    // are refused at full otherwise); an old Pi never acks, so roll over
+    outboxCount--;
+  }
+
+  MoneyEvent e;
+  e.seq = outboxSeq = nextOutboxSeq(outboxSeq);
+  e.coin = coinValue;
+  e.boot = outboxHdr.boot;
+  e.amount = amount;
+  e.tag = activeTag;
+  e.flags = flags;
+  e.uptimeS = millis() / 1000;
+  e.check = moneyEventCheck(e);
+
+  EEPROM.put(outboxAddr(outboxHead), e);
+  outboxHead = (outboxHead + 1) % OUTBOX_SIZE;
+  outboxCount++;
+
+  sendMoneyEvent(e);
+  outboxBackoffMs = OUTBOX_RETRY_MS;
+  outboxRetryAt = millis() + outboxBackoffMs;
+}
+
+void sendMoneyEvent(const MoneyEvent& e) {
+  unsigned long nowS = millis() / 1000;
+  uint16_t age = EVT_AGE_UNKNOWN;
+  if (e.boot == outboxHdr.boot && nowS - e.uptimeS < EVT_AGE_UNKNOWN) age = nowS - e.uptimeS;
+
+  Serial.print(F("EVT:"));
+  Serial.print(e.seq);
+  Serial.print(',');
+  Serial.print(e.coin);
+  Serial.print(',');
+  Serial.print(e.amount);
+  Serial.print(',');
+  Serial.print(e.tag);
+  Serial.print(',');
+  Serial.print(e.flags);
+  Serial.print(',');
+  Serial.print(age);
+  Serial.print(',');
+  Serial.println(outboxHdr.epoch);
+}
+
+// Resend unacked events, oldest first; returns how many went out
+uint8_t outboxResend() {
+  uint8_t sent = 0;
+  uint8_t idx = outboxTail();
+  for (uint8_t i = 0; i < outboxCount; i++) {
+    MoneyEvent e;
+    EEPROM.get(outboxAddr(idx), e);
+    if (!(e.flags & EVT_ACKED)) {
+      sendMoneyEvent(e);
+      sent++;
+    }
+    idx = (idx + 1) % OUTBOX_SIZE;
+  }
+  return sent;
+}
+
+// Refuse money we could not book; an ack frees a slot again.
+// One slot stays free for a coin already in flight when the inhibit engages
+bool outboxFull() {
+  return piWatchdogArmed && outboxCount >= OUTBOX_SIZE - 1;
+}
+
+void handleOutbox() {
+  if (outboxFull()) {
+    if (coinInputEnabled) Serial.println(F("OUTBOX_FULL"));
+    coinInputEnabled = false;
+  }
+
+  if (outboxCount == 0 || standalone) return;
+  if ((long)(millis() - outboxRetryAt) < 0) return;
+
+  if (outboxResend() > 0) {
+    outboxBackoffMs = min(outboxBackoffMs * 2, (unsigned long)OUTBOX_RETRY_MAX_MS);
+  }
+  outboxRetryAt = millis() + outboxBackoffMs;
+}
+
+// RESYNC: the Pi reopened the port and wants everything it hasn't acked
+void outboxResync() {
+  Serial.print(F("RESYNC:"));
+  Serial.println(outboxCount);
+  outboxResend();
+  outboxBackoffMs = OUTBOX_RETRY_MS;
+  outboxRetryAt = millis() + outboxBackoffMs;
+}
+
+// ACK:<seq> marks one event delivered; acked events at the tail are freed.
+// Only the flags byte changes: EEPROM.put skips cells that already match
+void outboxAck(uint16_t seq) {
+  uint8_t idx = outboxTail();
+  for (uint8_t i = 0; i < outboxCount; i++) {
+    MoneyEvent e;
+    EEPROM.get(outboxAddr(idx), e);
+    if (e.seq == seq && !(e.flags & EVT_ACKED)) {
+      e.flags |= EVT_ACKED;
+      EEPROM.put(outboxAddr(idx), e);
+      break;
+    }
+    idx = (idx + 1) % OUTBOX_SIZE;
+  }
+
+  while (outboxCount > 0) {
+    MoneyEvent e;
+    EEPROM.get(outboxAddr(outboxTail()), e);
+    if (!(e.flags & EVT_ACKED)) break;
+    outboxCount--;
+  }
+
+  if (!coinInputEnabled && outboxCount < OUTBOX_SIZE - 1) {
+    coinInputEnabled = true;
+    Serial.println(F("OUTBOX_OK"));
+  }
+}
+
+// ---------------- COIN INHIBIT ----------------
+void handleCoinInhibit() {
+  unsigned long now = millis();
+
+  if (blockAllCoins && now >= coinBlockUntil) {
+    // Blocking period expired, auto-unblock
+    blockAllCoins = false;
+    coinBlockUntil = 0;
+    Serial.println(F("COINS_AUTO_UNBLOCKED"));
+  }
+
+  uint8_t reasons = 0;
+  if (blockAllCoins) reasons |= INHIBIT_BLOCKED;
+  if (!coinInputEnabled) reasons |= INHIBIT_OUTBOX;
+  if (dispensing && inhibitWhileDispensing) reasons |= INHIBIT_DISPENSE;
+
+  if (reasons && !coinInhibitReasons) {
+    digitalWrite(COIN_INHIBIT_PIN, COIN_INHIBIT_LEVEL);
+    inhibitSinceMs = now;
+    inhibitCount++;
+    Serial.print(F("INHIBIT:ON,"));
+    Serial.println(reasons);
+  } else if (!reasons && coinInhibitReasons) {
+    if (!coinIsrAttached) {
+      dropCoinTrain();
+      attachInterrupt(digitalPinToInterrupt(COIN_PIN), coinISR, CHANGE);
+      coinIsrAttached = true;
+    }
+    digitalWrite(COIN_INHIBIT_PIN, !COIN_INHIBIT_LEVEL);
+    inhibitTotalMs += now - inhibitSinceMs;
+    Serial.print(F("INHIBIT:OFF,"));
+    Serial.println(now - inhibitSinceMs);
+  }
+  coinInhibitReasons = reasons;
+
+  // Once coins in flight have pulsed out nothing legitimate can arrive
+  if (reasons && coinIsrAttached && now - inhibitSinceMs > COIN_INHIBIT_GRACE_MS && coinPulseCount == 0) {
+    detachInterrupt(digitalPinToInterrupt(COIN_PIN));
+    coinIsrAttached = false;
+  }
+}
+
+// ---------------- TAMPER ----------------
+// Loop side of the string-pull check; returns a TAMPER_* reason
+uint8_t checkTrainTiming(uint8_t pulses, const CoinTiming& t) {
+  // Every counted pulse should have come back up before the train ended
+  if (t.widthN + 1 < pulses) return TAMPER_SHAPE;
+
+  if (t.widthN > 0 && (t.widthMin < PHYS_WIDTH_MIN_X10 || t.widthMax > PHYS_WIDTH_MAX_X10)) return TAMPER_WIDTH;
+  if (t.periodN > 0 && t.periodMax > PHYS_PERIOD_MAX_X10) return TAMPER_PERIOD;
+
+  // An acceptor's pulse generator is regular; a hand is not
+  if (t.periodN >= 2) {
+    uint32_t mean = t.periodSum / t.periodN;
+    if ((uint32_t)(t.periodMax - t.periodMin) * 100 > mean * TAMPER_SPREAD_PCT) return TAMPER_IRREGULAR;
+  }
+
+  const TimingSignature& sig = coinSignature;
+  if (sig.widthMax > 0 && t.widthN > 0) {
+    if ((uint32_t)t.widthMin * 100 < (uint32_t)sig.widthMin * (100 - SIG_TOLERANCE_PCT) ||
+        (uint32_t)t.widthMax * 100 > (uint32_t)sig.widthMax * (100 + SIG_TOLERANCE_PCT)) return TAMPER_WIDTH;
+  }
+  if (sig.periodMax > 0 && t.periodN > 0) {
+    if ((uint32_t)t.periodMin * 100 < (uint32_t)sig.periodMin * (100 - SIG_TOLERANCE_PCT) ||
+        (uint32_t)t.periodMax * 100 > (uint32_t)sig.periodMax * (100 + SIG_TOLERANCE_PCT)) return TAMPER_PERIOD;
+  }
+  return TAMPER_NONE;
+}
+
+void reportTamper(uint8_t reason, uint8_t pulses, const CoinTiming& t) {
+  Serial.print(F("TAMPER:"));
+  switch (reason) {
+    case TAMPER_WIDTH:     Serial.print(F("WIDTH")); break;
+    case TAMPER_PERIOD:    Serial.print(F("PERIOD")); break;
+    case TAMPER_IRREGULAR: Serial.print(F("IRREGULAR")); break;
+    default:               Serial.print(F("SHAPE")); break;
+  }
+  Serial.print(',');
+  Serial.print(pulses);
+  Serial.print(',');
+  Serial.print(t.widthMin / 10.0, 1);
+  Serial.print(',');
+  Serial.print(t.widthMax / 10.0, 1);
+  Serial.print(',');
+  Serial.print(t.periodMin / 10.0, 1);
+  Serial.print(',');
+  Serial.println(t.periodMax / 10.0, 1);
+
+  statsBump(coinStats[statsHead].tamper);
+
+  // Same path as BLOCK_COINS so the Pi sees it the usual way
+  blockAllCoins = true;
+  coinBlockUntil = millis() + TAMPER_BLOCK_MS;
+  Serial.print(F("COINS_BLOCKED:"));
+  Serial.println(TAMPER_BLOCK_MS);
+}
+
+// SIGNATURE:widthMin,widthMax,periodMin,periodMax in ms; zeros = not learned
+void showSignature() {
+  Serial.print(F("SIGNATURE:"));
+  Serial.print(coinSignature.widthMin / 10.0, 1);
+  Serial.print(',');
+  Serial.print(coinSignature.widthMax / 10.0, 1);
+  Serial.print(',');
+  Serial.print(coinSignature.periodMin / 10.0, 1);
+  Serial.print(',');
+  Serial.println(coinSignature.periodMax / 10.0, 1);
+}
+
+void clearSignature() {
+  memset(&coinSignature, 0, sizeof(coinSignature));
+  saveConfig();
+  showSignature();
+}
+
+// ---------------- COIN STATS ----------------
+void statsBump(uint8_t& counter) {
+  if (counter < 255) counter++;
+}
+
+void statsAdd(uint16_t& counter, uint16_t n) {
+  counter = (uint32_t)counter + n > 65535 ? 65535 : counter + n;
+}
+
+// Folds the ISR drop counters in and rotates buckets as time passes
+void handleCoinStats() {
+  noInterrupts();
+  uint16_t gate = isrGateDrops;
+  uint16_t relay = isrRelayDrops;
+  isrGateDrops = isrRelayDrops = 0;
+  interrupts();
+
+  while (millis() - statsBucketStart >= STATS_BUCKET_MS) {
+    statsBucketStart += STATS_BUCKET_MS;
+    statsHead = (statsHead + 1) % STATS_BUCKETS;
+    memset(&coinStats[statsHead], 0, sizeof(CoinStatsBucket));
+    if (statsFilled < STATS_BUCKETS) statsFilled++;
+  }
+
+  CoinStatsBucket& b = coinStats[statsHead];
+  statsAdd(b.gateDrops, gate);
+  statsAdd(b.relayDrops, relay);
+}
+
+void clearCoinStats() {
+  memset(coinStats, 0, sizeof(coinStats));
+  statsHead = 0;
+  statsFilled = 1;
+  statsBucketStart = millis();
+  Serial.println(F("COINSTATS_CLEARED"));
+}
+
+// COINSTATS:<window s>, then per-coin, reject and histogram lines
+void showCoinStats() {
+  uint16_t accepted[COIN_TABLE_MAX] = {0};
+  uint16_t hist[STATS_HIST_BINS] = {0};
+  uint16_t noise = 0, unknown = 0, tamper = 0, inflight = 0, gate = 0, relay = 0;
+
+  for (uint8_t i = 0; i < statsFilled; i++) {
+    const CoinStatsBucket& b = coinStats[(statsHead + STATS_BUCKETS - i) % STATS_BUCKETS];
+    for (uint8_t r = 0; r < COIN_TABLE_MAX; r++) statsAdd(accepted[r], b.accepted[r]);
+    for (uint8_t h = 0; h < STATS_HIST_BINS; h++) statsAdd(hist[h], b.unknownHist[h]);
+    statsAdd(noise, b.noise);
+    statsAdd(unknown, b.unknown);
+    statsAdd(tamper, b.tamper);
+    statsAdd(gate, b.gateDrops);
+    statsAdd(inflight, b.inflight);
+    statsAdd(relay, b.relayDrops);
+  }
+
+  Serial.print(F("COINSTATS:"));
+  Serial.println((statsFilled - 1) * (STATS_BUCKET_MS / 1000) + (millis() - statsBucketStart) / 1000);
+
+  Serial.print(F("COINSTATS_ACCEPTED:"));
+  for (uint8_t r = 0; r < coinTableCount; r++) {
+    if (r > 0) Serial.print(',');
+    Serial.print(coinTable[r].peso);
+    Serial.print('=');
+    Serial.print(accepted[r]);
+  }
+  Serial.println();
+
+  Serial.print(F("COINSTATS_REJECTED:noise="));
+  Serial.print(noise);
+  Serial.print(F(",unknown="));
+  Serial.print(unknown);
+  Serial.print(F(",tamper="));
+  Serial.print(tamper);
+  Serial.print(F(",gate="));
+  Serial.print(gate);
+  Serial.print(F(",inflight="));
+  Serial.print(inflight);
+  Serial.print(F(",relay="));
+  Serial.println(relay);
+
+  // Only the pulse counts that actually occurred
+  Serial.print(F("COINSTATS_UNKNOWN_HIST:"));
+  bool first = true;
+  for (uint8_t h = 0; h < STATS_HIST_BINS; h++) {
+    if (hist[h] == 0) continue;
+    if (!first) Serial.print(',');
+    first = false;
+    Serial.print(h + 1);
+    if (h == STATS_HIST_BINS - 1) Serial.print('+');
+    Serial.print('=');
+    Serial.print(hist[h]);
+  }
+  Serial.println();
+}
+
+// ---------------- COIN TABLE ----------------
+const CoinEntry* findCoinByPulses(uint8_t pulses) {
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    if (pulses >= coinTable[i].minPulses && pulses <= coinTable[i].maxPulses) return &coinTable[i];
+  }
+  return NULL;
+}
+
+CoinEntry* findCoinByPeso(uint8_t peso) {
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    if (coinTable[i].peso == peso) return &coinTable[i];
+  }
+  return NULL;
+}
+
+bool coinEntryValid(const CoinEntry& e) {
+  return e.minPulses >= 1 && e.minPulses <= e.maxPulses && e.maxPulses <= COIN_PULSES_MAX &&
+         e.peso >= 1 && e.ml <= ORDER_MAX_ML && e.standaloneML <= ORDER_MAX_ML &&
+         e.seconds <= COIN_SECONDS_MAX && (e.ml > 0 || e.seconds > 0);
+}
+
+// Rows must be valid, pulse windows disjoint and peso values unique
+bool coinTableValid(const CoinEntry* t, uint8_t n) {
+  if (n < 1 || n > COIN_TABLE_MAX) return false;
+  for (uint8_t i = 0; i < n; i++) {
+    if (!coinEntryValid(t[i])) return false;
+    for (uint8_t j = i + 1; j < n; j++) {
+      if (t[i].peso == t[j].peso) return false;
+      if (t[i].minPulses <= t[j].maxPulses && t[j].minPulses <= t[i].maxPulses) return false;
+    }
+  }
+  return true;
+}
+
+// <min>[-<max>]=<peso>/<ml>/<seconds>[/<standalone ml>]
+bool parseCoinEntry(char* s, CoinEntry& e) {
+  char* p;
+  long lo = strtol(s, &p, 10);
+  long hi = lo;
+  if (*p == '-') hi = strtol(p + 1, &p, 10);
+  if (*p != '=') return false;
+  long peso = strtol(p + 1, &p, 10);
+  if (*p != '/') return false;
+  long ml = strtol(p + 1, &p, 10);
+  if (*p != '/') return false;
+  long sec = strtol(p + 1, &p, 10);
+  long sa = ml;
+  if (*p == '/') sa = strtol(p + 1, &p, 10);
+  if (*p != '\0') return false;
+  if (lo < 0 || hi > 255 || peso > 255 || ml < 0 || ml > 65535 || sec < 0 || sec > 65535 || sa < 0 || sa > 65535) return false;
+
+  e.minPulses = lo;
+  e.maxPulses = hi;
+  e.peso = peso;
+  e.ml = ml;
+  e.seconds = sec;
+  e.standaloneML = sa;
+  return coinEntryValid(e);
+}
+
+// SETTABLE:<row>;<row>;... replaces the whole table or nothing at all
+void setCoinTable(char* arg) {
+  CoinEntry t[COIN_TABLE_MAX];
+  uint8_t n = 0;
+
+  for (char* tok = strtok(arg, ";"); tok; tok = strtok(NULL, ";")) {
+    if (n >= COIN_TABLE_MAX) {
+      Serial.print(F("SETTABLE_ERROR:TOO_MANY,"));
+      Serial.println(COIN_TABLE_MAX);
+      return;
+    }
+    if (!parseCoinEntry(tok, t[n])) {
+      Serial.print(F("SETTABLE_ERROR:ROW,"));
+      Serial.println(n + 1);
+      return;
+    }
+    n++;
+  }
+
+  if (!coinTableValid(t, n)) {
+    Serial.println(F("SETTABLE_ERROR:OVERLAP"));
+    return;
+  }
+
+  memset(coinTable, 0, sizeof(coinTable));
+  memcpy(coinTable, t, n * sizeof(CoinEntry));
+  coinTableCount = n;
+  saveConfig();
+  Serial.print(F("SETTABLE_OK:"));
+  Serial.println(n);
+  showCoinTable();
+}
+
+// Same syntax as SETTABLE so the Pi can read, edit and send it back
+void showCoinTable() {
+  Serial.print(F("COINTABLE:"));
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    const CoinEntry& e = coinTable[i];
+    if (i > 0) Serial.print(';');
+    Serial.print(e.minPulses);
+    if (e.maxPulses != e.minPulses) {
+      Serial.print('-');
+      Serial.print(e.maxPulses);
+    }
+    Serial.print('=');
+    Serial.print(e.peso);
+    Serial.print('/');
+    Serial.print(e.ml);
+    Serial.print('/');
+    Serial.print(e.seconds);
+    Serial.print('/');
+    Serial.print(e.standaloneML);
+  }
+  Serial.println();
+}
+
+// ---------------- CONFIG ----------------
+uint16_t crc16Update(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+int configAddr(uint8_t slot) {
+  return CONFIG_EEPROM_ADDR + slot * CONFIG_SLOT_SIZE;
+}
+
+// CRC straight from EEPROM so records longer than ours still verify
+uint16_t configCrc(uint8_t slot, uint8_t length) {
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = CONFIG_HEADER_SIZE; i < length; i++) {
+    crc = crc16Update(crc, EEPROM.read(configAddr(slot) + i));
+  }
+  return crc;
+}
+
+void configDefaults(ConfigRecord& c) {
+  memset(&c, 0, sizeof(c));
+  c.coinPulses[0] = 1;
+  c.coinPulses[1] = 5;
+  c.coinPulses[2] = 10;
+  c.autoCalEnabled = 0;
+  c.pulsesPerLiter = PPL_DEFAULT;
+  c.curve.magic = FLOWCURVE_MAGIC;
+  c.curve.count = 0;
+  c.priceML[0] = 50;
+  c.priceML[1] = 250;
+  c.priceML[2] = 500;
+  upgradeConfigV1(c);
+}
+
+// Schema 1 knew only P1/P5/P10 with one exact pulse count each
+void upgradeConfigV1(ConfigRecord& c) {
+  static const uint8_t pesos[3] = {1, 5, 10};
+  static const uint16_t mls[3] = {50, 250, 500};
+  static const uint16_t seconds[3] = {300, 1800, 3600};
+
+  c.coinCount = 3;
+  for (uint8_t i = 0; i < 3; i++) {
+    CoinEntry& e = c.coins[i];
+    e.minPulses = e.maxPulses = c.coinPulses[i];
+    e.peso = pesos[i];
+    e.ml = mls[i];
+    e.seconds = seconds[i];
+    e.standaloneML = c.priceML[i];
+  }
+  // Calibration may have left two coins on one count; fall back to stock
+  if (!coinTableValid(c.coins, c.coinCount)) {
+    for (uint8_t i = 0; i < 3; i++) c.coins[i].minPulses = c.coins[i].maxPulses = pesos[i];
+  }
+}
+
+void applyConfig(const ConfigRecord& c) {
+  if (coinTableValid(c.coins, c.coinCount)) {
+    coinTableCount = c.coinCount;
+    memcpy(coinTable, c.coins, sizeof(coinTable));
+  } else {
+    ConfigRecord d;
+    configDefaults(d);
+    coinTableCount = d.coinCount;
+    memcpy(coinTable, d.coins, sizeof(coinTable));
+    Serial.println(F("CONFIG_ERROR:COINTABLE,DEFAULTS"));
+  }
+  autoCalHdr.enabled = c.autoCalEnabled ? 1 : 0;
+  pulsesPerLiter = c.pulsesPerLiter;
+  if (isnan(pulsesPerLiter) || pulsesPerLiter < PPL_MIN || pulsesPerLiter > PPL_MAX)
+    pulsesPerLiter = PPL_DEFAULT;
+  coinSignature = c.signature;
+  if (coinSignature.widthMin > coinSignature.widthMax || coinSignature.periodMin > coinSignature.periodMax)
+    memset(&coinSignature, 0, sizeof(coinSignature));
+  flowCurve = c.curve;
+  if (flowCurve.magic != FLOWCURVE_MAGIC || flowCurve.count > FLOWCURVE_POINTS) {
+    flowCurve.magic = FLOWCURVE_MAGIC;
+    flowCurve.count = 0;
+  }
+  autoCalReset();
+}
+
+// Settings from before the config store: offsets 0/4/8/12, curve at 16,
+// prices at 232. Coin pulses were written as one uint8_t (the byte after
+// it left as erased, 0xFF) or by an older int writer (high byte 0x00);
+// take the low byte only when the next one is one of those. Returns
+// false if nothing usable.
+bool migrateLegacyConfig(ConfigRecord& c) {
+  bool found = false;
+  for (uint8_t i = 0; i < 3; i++) {
+    uint8_t pulses = EEPROM.read(i * 4);
+    uint8_t high = EEPROM.read(i * 4 + 1);
+    if ((high == 0x00 || high == 0xFF) && pulses >= 1 && pulses <= 30) {
+      c.coinPulses[i] = pulses;
+      found = true;
+    }
+  }
+
+  float ppl;
+  EEPROM.get(12, ppl);
+  if (!isnan(ppl) && ppl >= PPL_MIN && ppl <= PPL_MAX) {
+    c.pulsesPerLiter = ppl;
+    found = true;
+  }
+
+  FlowCurve curve;
+  EEPROM.get(LEGACY_FLOWCURVE_ADDR, curve);
+  if (curve.magic == FLOWCURVE_MAGIC && curve.count <= FLOWCURVE_POINTS) c.curve = curve;
+
+  PriceTable prices;
+  EEPROM.get(LEGACY_PRICE_ADDR, prices);
+  if (prices.magic == PRICE_MAGIC) {
+    for (uint8_t i = 0; i < 3; i++) c.priceML[i] = prices.ml[i];
+  }
+
+  c.autoCalEnabled = autoCalHdr.enabled;   // header already validated
+  upgradeConfigV1(c);
+  return found;
+}
+
+// One pass over the slots; the newest valid generation wins
+void loadConfig() {
+  ConfigRecord c;
+  configDefaults(c);
+
+  int8_t best = -1;
+  uint8_t bestLen = 0;
+  bool sawRecord = false;
+  for (uint8_t slot = 0; slot < CONFIG_SLOTS; slot++) {
+    ConfigRecord h;
+    for (uint8_t i = 0; i < CONFIG_HEADER_SIZE; i++) ((uint8_t*)&h)[i] = EEPROM.read(configAddr(slot) + i);
+    if (h.magic != CONFIG_MAGIC) continue;
+    sawRecord = true;
+    if (h.length <= CONFIG_HEADER_SIZE || h.length > CONFIG_SLOT_SIZE) continue;
+    if (configCrc(slot, h.length) != h.crc) continue;
+    if (best < 0 || (int16_t)(h.gen - configGen) > 0) {
+      best = slot;
+      bestLen = h.length;
+      configGen = h.gen;
+    }
+  }
+
+  if (best >= 0) {
+    // Shorter (older schema) records keep the defaults for the missing tail
+    uint8_t n = min(bestLen, (uint8_t)sizeof(ConfigRecord));
+    for (uint8_t i = 0; i < n; i++) ((uint8_t*)&c)[i] = EEPROM.read(configAddr(best) + i);
+    if (c.version < 2) upgradeConfigV1(c);
+    configSlot = best;
+    applyConfig(c);
+    Serial.print(F("CONFIG_LOADED:v"));
+    Serial.print(c.version);
+    Serial.print(',');
+    Serial.print(configSlot);
+    Serial.print(',');
+    Serial.println(configGen);
+    if (c.version != CONFIG_VERSION) saveConfig();   // rewrite in the current schema
+    return;
+  }
+
+  if (!sawRecord && migrateLegacyConfig(c)) {
+    applyConfig(c);
+    saveConfig();
+    Serial.println(F("CONFIG_MIGRATED:LEGACY"));
+    return;
+  }
+
+  // Nothing trustworthy: run on defaults and say so
+  applyConfig(c);
+  saveConfig();
+  Serial.print(F("CONFIG_ERROR:"));
+  Serial.println(sawRecord ? F("CRC,DEFAULTS") : F("EMPTY,DEFAULTS"));
+}
+
+void saveConfig() {
+  ConfigRecord c;
+  configDefaults(c);
+  c.magic = CONFIG_MAGIC;
+  c.version = CONFIG_VERSION;
+  c.length = sizeof(ConfigRecord);
+  c.gen = ++configGen;
+  c.autoCalEnabled = autoCalHdr.enabled;
+  c.pulsesPerLiter = pulsesPerLiter;
+  c.curve = flowCurve;
+  c.signature = coinSignature;
+  c.coinCount = coinTableCount;
+  memcpy(c.coins, coinTable, sizeof(coinTable));
+
+  // Schema 1 fields, so an older sketch reading this record still works
+  static const uint8_t pesos[3] = {1, 5, 10};
+  for (uint8_t i = 0; i < 3; i++) {
+    const CoinEntry* e = findCoinByPeso(pesos[i]);
+    if (e) {
+      c.coinPulses[i] = e->minPulses;
+      c.priceML[i] = e->standaloneML;
+    }
+  }
+
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = CONFIG_HEADER_SIZE; i < sizeof(ConfigRecord); i++) crc = crc16Update(crc, ((uint8_t*)&c)[i]);
+  c.crc = crc;
+
+  configSlot = (configSlot + 1) % CONFIG_SLOTS;
+  EEPROM.put(configAddr(configSlot), c);
+}
+
+void showConfig() {
+  Serial.print(F("CONFIG:v"));
+  Serial.print(CONFIG_VERSION);
+  Serial.print(',');
+  Serial.print(configSlot);
+  Serial.print(',');
+  Serial.print(configGen);
+  Serial.print(',');
+  Serial.println(sizeof(ConfigRecord));
+}
+
 // ---------------- SERIAL COMMAND HANDLER ----------------
 void handleSerialCommand() {
   while (Serial.available()) {
     char c = Serial.read();
     
     if (c == '\n' || c == '\r') {
-      if (cmdIndex > 0) {
+      if (cmdOverflow) {
+        Serial.println(F("ERROR: Command too long"));
+      } else if (cmdIndex > 0) {
         cmdBuffer[cmdIndex] = '\0';
         processCommand(cmdBuffer);
-        cmdIndex = 0;
       }
+      if (cmdIndex > 0) piSeen();   // after the command; CAL etc. block for a while
+      cmdIndex = 0;
+      cmdOverflow = false;
     } else if (cmdIndex < sizeof(cmdBuffer) - 1) {
       cmdBuffer[cmdIndex++] = c;
+    } else {
+      cmdOverflow = true;
     }
   }
 }
@@ -373,14 +2109,52 @@ void processCommand(char* cmd) {
     *p = toupper(*p);
   }
 
-  if (strcmp(cmd, "CAL") == 0) calibrateCoins();
+  if (strcmp(cmd, "CAL") == 0) startCoinCal(COINCAL_DEFAULT_K);
+  else if (strcmp(cmd, "COINCAL") == 0) startCoinCal(COINCAL_DEFAULT_K);
+  else if (strncmp(cmd, "COINCAL:", 8) == 0) startCoinCal(atoi(cmd + 8));
+  else if (strcmp(cmd, "COINCAL_SKIP") == 0) skipCoinCalRow();
+  else if (strcmp(cmd, "COINCAL_ABORT") == 0) { if (coinCalActive) abortCoinCal(); }
   else if (strcmp(cmd, "FLOWCAL") == 0) calibrateFlow();
+  else if (strcmp(cmd, "FLOWCAL CURVE") == 0) calibrateFlowCurve();
   else if (strcmp(cmd, "STATUS") == 0) showStatus();
   else if (strcmp(cmd, "RESET") == 0) resetSystem();
   else if (strcmp(cmd, "TEST") == 0) testCoinPatterns();
   else if (strcmp(cmd, "WATER") == 0) setMode(MODE_WATER);
   else if (strcmp(cmd, "CHARGING") == 0) setMode(MODE_CHARGING);
   else if (strcmp(cmd, "CLEAR") == 0) clearCredits();
+  else if (strcmp(cmd, "JOURNAL") == 0) dumpJournal();
+  else if (strcmp(cmd, "AUTOCAL ON") == 0) setAutoCal(true);
+  else if (strcmp(cmd, "AUTOCAL OFF") == 0) setAutoCal(false);
+  else if (strcmp(cmd, "CALHIST") == 0) showAutoCalHistory();
+  else if (strncmp(cmd, "REFML:", 6) == 0) autoCalReference(atoi(cmd + 6));
+  else if (strncmp(cmd, "PROGRESS_HZ:", 12) == 0) setProgressRate(atoi(cmd + 12));
+  else if (strncmp(cmd, "ORDER:", 6) == 0) queueOrders(cmd + 6);
+  else if (strncmp(cmd, "TAG:", 4) == 0) selectTag(atoi(cmd + 4));
+  else if (strncmp(cmd, "TAG_CLEAR:", 10) == 0) clearTag(atoi(cmd + 10));
+  else if (strcmp(cmd, "WALLETS") == 0) showWallets();
+  else if (strcmp(cmd, "PING") == 0) {
+    piWatchdogArmed = true;
+    Serial.print(F("PONG:"));
+    Serial.println(outboxCount);
+  }
+  else if (strcmp(cmd, "RESYNC") == 0) outboxResync();
+  else if (strcmp(cmd, "CONFIG") == 0) showConfig();
+  else if (strncmp(cmd, "SETTABLE:", 9) == 0) setCoinTable(cmd + 9);
+  else if (strcmp(cmd, "COINTABLE") == 0) showCoinTable();
+  else if (strcmp(cmd, "COINSTATS") == 0) showCoinStats();
+  else if (strcmp(cmd, "SIGNATURE") == 0) showSignature();
+  else if (strcmp(cmd, "SIGNATURE_CLEAR") == 0) clearSignature();
+  else if (strcmp(cmd, "COINSTATS_CLEAR") == 0) clearCoinStats();
+  else if (strncmp(cmd, "ACK:", 4) == 0) outboxAck(strtoul(cmd + 4, NULL, 10));
+  else if (strncmp(cmd, "SAPRICE:", 8) == 0) setStandalonePrice(cmd + 8);
+  else if (strcmp(cmd, "SAPRICE") == 0) showPrices();
+  else if (strcmp(cmd, "ORDERS") == 0) showOrders();
+  else if (strcmp(cmd, "ORDER_CLEAR") == 0) { clearOrders(); showOrders(); }
+  else if (strcmp(cmd, "ORDERMODE COIN") == 0) { orderMode = ORDER_BY_COIN; showOrders(); }
+  else if (strcmp(cmd, "ORDERMODE CREDIT") == 0) { orderMode = ORDER_BY_CREDIT; showOrders(); }
+  else if (strcmp(cmd, "STOP") == 0) {
+    if (dispensing) stopDispenseEarly();
+  }
   else if (strncmp(cmd, "MODE ", 5) == 0) {
     char* modeStr = cmd + 5;
     if (strcmp(modeStr, "WATER") == 0) setMode(MODE_WATER);
@@ -398,50 +2172,155 @@ void processCommand(char* cmd) {
       Serial.println(blockMs);
     }
   }
+  else if (strcmp(cmd, "INHIBIT_DISPENSE ON") == 0) inhibitWhileDispensing = true;
+  else if (strcmp(cmd, "INHIBIT_DISPENSE OFF") == 0) inhibitWhileDispensing = false;
   else if (strcmp(cmd, "UNBLOCK_COINS") == 0) {
     blockAllCoins = false;
     coinBlockUntil = 0;
     Serial.println(F("COINS_UNBLOCKED"));
   }
   else {
-    Serial.println(F("Unknown command. Use: CAL, FLOWCAL, STATUS, RESET, TEST, MODE [WATER|CHARGING], WATER, CHARGING, CLEAR, BLOCK_COINS:ms, UNBLOCK_COINS"));
+    Serial.println(F("Unknown command. Use: CAL, COINCAL[:k], COINCAL_SKIP, COINCAL_ABORT, FLOWCAL [CURVE], STATUS, RESET, TEST, MODE [WATER|CHARGING], WATER, CHARGING, CLEAR, JOURNAL, STOP, AUTOCAL ON|OFF, REFML:ml, CALHIST, PROGRESS_HZ:n, ORDER:ml,..., ORDERS, ORDER_CLEAR, ORDERMODE [COIN|CREDIT], TAG:n, TAG_CLEAR:n, WALLETS, PING, RESYNC, ACK:seq, SAPRICE[:peso:ml], CONFIG, SETTABLE:rows, COINTABLE, COINSTATS[_CLEAR], SIGNATURE[_CLEAR], BLOCK_COINS:ms, UNBLOCK_COINS, INHIBIT_DISPENSE ON|OFF"));
   }
 }
 
+// Only chooses where the next coins go; no credit is touched
 void setMode(uint8_t newMode) {
-  if (dispensing) {
-    Serial.println(F("ERROR: Cannot change mode while dispensing"));
-    return;
-  }
-  
   currentMode = newMode;
   Serial.print(F("Mode set to: "));
   Serial.println(currentMode == MODE_WATER ? "WATER" : "CHARGING");
-  
-  // Reset credits when switching modes to prevent confusion
-  if (currentMode == MODE_WATER) {
-    chargeSeconds = 0;
-    Serial.println(F("Charging credits cleared"));
-  } else {
+  if (currentMode == MODE_WATER) bindWaterTag();
+}
+
+// ---------------- WALLETS ----------------
+Wallet* findWallet(uint8_t tag, bool create) {
+  Wallet* freeSlot = NULL;
+  for (uint8_t i = 0; i < WALLET_COUNT; i++) {
+    if (wallets[i].used && wallets[i].tag == tag) return &wallets[i];
+    if (!wallets[i].used && !freeSlot) freeSlot = &wallets[i];
+  }
+  if (!create) return NULL;
+  if (!freeSlot) {
+    // Recycle an empty wallet that nobody is using
+    for (uint8_t i = 1; i < WALLET_COUNT; i++) {
+      Wallet& w = wallets[i];
+      if (w.creditML == 0 && w.chargeSeconds == 0 && w.tag != activeTag && w.tag != waterTag) {
+        freeSlot = &w;
+        break;
+      }
+    }
+  }
+  if (!freeSlot) return &wallets[0];   // full: fall back to walk-in wallet
+  freeSlot->used = true;
+  freeSlot->tag = tag;
+  freeSlot->creditML = 0;
+  freeSlot->chargeSeconds = 0;
+  return freeSlot;
+}
+
+// Hand the dispenser to the active tag once it is idle. creditML goes back
+// to the old owner's wallet and the new owner's water credit comes out.
+void bindWaterTag() {
+  if (activeTag == waterTag) return;
+  if (dispensing || settlePending || orderCount > 0 || awaitCupClear) return;
+
+  Wallet* old = findWallet(waterTag, true);
+  old->creditML += creditML + pendingCreditML;
+  pendingCreditML = 0;
+
+  Wallet* w = findWallet(activeTag, true);
+  creditML = w->creditML;
+  w->creditML = 0;
+  waterTag = activeTag;
+  Serial.print(F("WATER_TAG:"));
+  Serial.println(waterTag);
+}
+
+void selectTag(int tag) {
+  if (tag < 0 || tag > 255) {
+    Serial.println(F("ERROR: TAG must be 0-255"));
+    return;
+  }
+  Wallet* w = findWallet(tag, true);
+  if (w->tag != tag) {
+    Serial.println(F("ERROR: No free wallet"));
+    return;
+  }
+  activeTag = tag;
+  if (currentMode == MODE_WATER) bindWaterTag();
+  Serial.print(F("ACTIVE_TAG:"));
+  Serial.println(activeTag);
+}
+
+// Charging seconds are consumed by the Pi; TAG_CLEAR:n settles a wallet
+void clearTag(int tag) {
+  Wallet* w = findWallet(tag, false);
+  if (!w) return;
+  w->chargeSeconds = 0;
+  if (tag == waterTag) {
     creditML = 0;
-    Serial.println(F("Water credits cleared"));
+    pendingCreditML = 0;
+    clearOrders();
+  }
+  w->creditML = 0;
+  if (tag != 0 && tag != activeTag && tag != waterTag) w->used = false;
+  Serial.print(F("TAG_CLEARED:"));
+  Serial.println(tag);
+}
+
+uint16_t activeChargeSeconds() {
+  Wallet* w = findWallet(activeTag, false);
+  return w ? w->chargeSeconds : 0;
+}
+
+void showWallets() {
+  for (uint8_t i = 0; i < WALLET_COUNT; i++) {
+    const Wallet& w = wallets[i];
+    if (!w.used) continue;
+    Serial.print(F("WALLET:"));
+    Serial.print(w.tag);
+    Serial.print(F(","));
+    Serial.print(w.tag == waterTag ? creditML + pendingCreditML + w.creditML : w.creditML);
+    Serial.print(F(","));
+    Serial.print(w.chargeSeconds);
+    if (w.tag == activeTag) Serial.print(F(",ACTIVE"));
+    if (w.tag == waterTag) Serial.print(F(",WATER"));
+    Serial.println();
   }
 }
 
+void resetWallets() {
+  for (uint8_t i = 0; i < WALLET_COUNT; i++) {
+    wallets[i].used = (i == 0);
+    wallets[i].tag = 0;
+    wallets[i].creditML = 0;
+    wallets[i].chargeSeconds = 0;
+  }
+  activeTag = 0;
+  waterTag = 0;
+}
+
 // ---------------- STATUS REPORTING ----------------
 void reportStatus() {
   bool changed = false;
   
-  if (creditML != last_creditML || chargeSeconds != last_chargeSeconds || 
-      dispensing != last_dispensing || flowPulseCount != last_flowCount) {
+  // Flow count changes are covered by DP frames while dispensing
+  uint16_t chargeSeconds = activeChargeSeconds();
+  if (creditML != last_creditML || pendingCreditML != last_pendingML || chargeSeconds != last_chargeSeconds || 
+      dispensing != last_dispensing || (!dispensing && flowPulseCount != last_flowCount) ||
+      coinInhibitReasons != last_inhibit) {
     changed = true;
   }
   
   if (changed) {
     Serial.print(F("MODE:"));
     Serial.println(currentMode == MODE_WATER ? "WATER" : "CHARGING");
+    Serial.print(F("ACTIVE_TAG:"));
+    Serial.println(activeTag);
     Serial.print(F("CREDIT_ML:"));
     Serial.println(creditML);
+    Serial.print(F("PENDING_ML:"));
+    Serial.println(pendingCreditML);
     Serial.print(F("CHARGE_SECONDS:"));
     Serial.println(chargeSeconds);
     Serial.print(F("DISPENSING:"));
@@ -450,11 +2329,17 @@ void reportStatus() {
     Serial.println(flowPulseCount);
     Serial.print(F("COINS_BLOCKED:"));
     Serial.println(blockAllCoins ? "YES" : "NO");
+    Serial.print(F("COIN_INHIBIT:"));
+    Serial.print(coinInhibitReasons);
+    Serial.print(',');
+    Serial.println(coinInhibitReasons ? millis() - inhibitSinceMs : 0);
     
     last_creditML = creditML;
+    last_pendingML = pendingCreditML;
     last_chargeSeconds = chargeSeconds;
     last_dispensing = dispensing;
     last_flowCount = flowPulseCount;
+    last_inhibit = coinInhibitReasons;
   }
 }
 
@@ -463,15 +2348,39 @@ void showStatus() {
   Serial.print(F("Current Mode: ")); 
   Serial.println(currentMode == MODE_WATER ? "WATER" : "CHARGING");
   Serial.print(F("Water Credit: ")); Serial.print(creditML); Serial.println(F(" mL"));
-  Serial.print(F("Charging Credit: ")); Serial.print(chargeSeconds); Serial.println(F(" seconds"));
+  Serial.print(F("Queued Credit: ")); Serial.print(pendingCreditML); Serial.println(F(" mL"));
+  Serial.print(F("Charging Credit: ")); Serial.print(activeChargeSeconds()); Serial.println(F(" seconds"));
+  Serial.print(F("Active tag: ")); Serial.print(activeTag);
+  Serial.print(F(", water tag: ")); Serial.println(waterTag);
+  showWallets();
   Serial.print(F("Dispensing: ")); Serial.println(dispensing ? "YES" : "NO");
   Serial.print(F("Flow pulses: ")); Serial.println(flowPulseCount);
   Serial.print(F("Flow mL: ")); Serial.println(pulsesToML(flowPulseCount), 2);
   Serial.print(F("Flow calibration: ")); Serial.println(pulsesPerLiter);
-  Serial.print(F("Coin patterns - P1: ")); Serial.print(coin1P_pulses);
-  Serial.print(F(", P5: ")); Serial.print(coin5P_pulses);
-  Serial.print(F(", P10: ")); Serial.println(coin10P_pulses);
+  Serial.print(F("Flow curve points: ")); Serial.println(flowCurve.count);
+  for (uint8_t i = 0; i < flowCurve.count; i++) {
+    Serial.print(F("  ")); Serial.print(flowCurve.freqX10[i] / 10.0, 1);
+    Serial.print(F(" Hz -> K ")); Serial.println(kFactorAt(flowCurve.freqX10[i]));
+  }
+  Serial.print(F("Auto-calibration: ")); Serial.print(autoCalHdr.enabled ? "ON" : "OFF");
+  Serial.print(F(", samples: ")); Serial.print(autoCalSamples);
+  Serial.print(F(", estimate: ")); Serial.println(autoCalEstimate, 1);
+  showCoinTable();
+  Serial.print(F("Standalone: ")); Serial.print(standalone ? "YES" : "NO");
+  Serial.print(F(", watchdog: ")); Serial.print(piWatchdogArmed ? "ARMED" : "OFF");
+  Serial.print(F(", outbox: ")); Serial.print(outboxCount);
+  Serial.print(F(" (last seq ")); Serial.print(outboxSeq); Serial.println(F(")"));
+  showPrices();
   Serial.print(F("Coins blocked: ")); Serial.println(blockAllCoins ? "YES" : "NO");
+  Serial.print(F("Coin inhibit: ")); Serial.print(coinInhibitReasons ? "ON" : "OFF");
+  if (coinInhibitReasons) {
+    Serial.print(F(" (reasons ")); Serial.print(coinInhibitReasons);
+    Serial.print(F(", ")); Serial.print(millis() - inhibitSinceMs); Serial.print(F(" ms)"));
+  }
+  Serial.print(F(", ISR ")); Serial.print(coinIsrAttached ? "attached" : "detached");
+  Serial.print(F(", total ")); Serial.print(inhibitTotalMs / 1000);
+  Serial.print(F(" s over ")); Serial.print(inhibitCount); Serial.println(F(" periods"));
+  Serial.print(F("Inhibit while dispensing: ")); Serial.println(inhibitWhileDispensing ? "ON" : "OFF");
   if (blockAllCoins) {
     Serial.print(F("Block until: ")); Serial.print(coinBlockUntil);
     Serial.print(F(" ("));
@@ -486,6 +2395,42 @@ float pulsesToML(unsigned long pulses) {
   return (pulses / pulsesPerLiter) * 1000.0;
 }
 
+// K-factor (pulses per liter) at a pulse frequency, interpolated in Q10
+uint16_t kFactorAt(uint16_t freqX10) {
+  uint16_t factor = 1024;
+  uint8_t n = flowCurve.count;
+  if (n > 0) {
+    if (freqX10 <= flowCurve.freqX10[0]) {
+      factor = flowCurve.factorQ10[0];
+    } else if (freqX10 >= flowCurve.freqX10[n - 1]) {
+      factor = flowCurve.factorQ10[n - 1];
+    } else {
+      for (uint8_t i = 0; i + 1 < n; i++) {
+        uint16_t f0 = flowCurve.freqX10[i], f1 = flowCurve.freqX10[i + 1];
+        if (freqX10 < f1) {
+          int32_t k0 = flowCurve.factorQ10[i], k1 = flowCurve.factorQ10[i + 1];
+          factor = k0 + (k1 - k0) * (int32_t)(freqX10 - f0) / (int32_t)(f1 - f0);
+          break;
+        }
+      }
+    }
+  }
+  return (uint16_t)(((uint32_t)pulsesPerLiter * factor) >> 10);
+}
+
+// Microliters for a pulse count at a given frequency (one window's worth)
+unsigned long pulsesToUL(unsigned long pulses, uint16_t freqX10) {
+  return pulses * 1000000UL / kFactorAt(freqX10);
+}
+
+// Flow rate in mL/s x10 for a pulse count over an interval
+uint16_t flowRateX10(unsigned long pulses, unsigned long ms) {
+  if (ms == 0) return 0;
+  uint16_t freqX10 = (uint16_t)min(pulses * 10000UL / ms, 65535UL);
+  unsigned long rate = pulsesToUL(pulses, freqX10) * 10UL / ms;
+  return rate > 65535UL ? 65535 : (uint16_t)rate;
+}
+
 bool detectCup() {
   digitalWrite(CUP_TRIG_PIN, LOW);
   delayMicroseconds(2);
@@ -508,89 +2453,328 @@ void handleInactivity() {
 
 void clearCredits() {
   creditML = 0;
-  chargeSeconds = 0;
+  pendingCreditML = 0;
+  clearOrders();
+  resetWallets();
   Serial.println(F("All credits cleared"));
   lastActivity = millis();
 }
 
 // ---------------- CALIBRATION ----------------
-void calibrateCoins() {
+// COINCAL[:K] -- CAL is the same with the default K
+void startCoinCal(uint8_t k) {
+  if (k < 1 || k > COINCAL_MAX_K) {
+    Serial.print(F("Invalid sample count. Use: COINCAL:1.."));
+    Serial.println(COINCAL_MAX_K);
+    return;
+  }
   Serial.println(F("=== COIN CALIBRATION ==="));
-  Serial.println(F("Insert coins when prompted..."));
+  Serial.println(F("Insert coins when prompted. COINCAL_SKIP skips a coin, COINCAL_ABORT stops."));
+
+  memset(coinCalMin, 0, sizeof(coinCalMin));
+  memset(&coinCalAll, 0, sizeof(coinCalAll));
+  memset(coinCalMax, 0, sizeof(coinCalMax));
+  coinCalK = k;
+  coinCalRow = 0;
+  coinCalActive = true;
+  dropCoinTrain();
+  beginCoinCalRow();
+}
 
-  coinPulseCount = 0;
-  Serial.println(F("Insert 1 Peso coin..."));
-  waitForCoinPulse();
-  coin1P_pulses = coinPulseCount;
-  EEPROM.put(0, coin1P_pulses);
-  Serial.print(F("P1 coin: ")); Serial.print(coin1P_pulses); Serial.println(F(" pulses"));
+void beginCoinCalRow() {
+  coinCalSamples = 0;
+  memset(&coinCalTiming, 0, sizeof(coinCalTiming));
+  promptCoinCal();
+}
 
-  coinPulseCount = 0;
-  Serial.println(F("Insert 5 Peso coin..."));
-  waitForCoinPulse();
-  coin5P_pulses = coinPulseCount;
-  EEPROM.put(4, coin5P_pulses);
-  Serial.print(F("P5 coin: ")); Serial.print(coin5P_pulses); Serial.println(F(" pulses"));
+void promptCoinCal() {
+  coinCalStepMs = millis();
+  Serial.print(F("COINCAL_STEP:"));
+  Serial.print(coinTable[coinCalRow].peso);
+  Serial.print(',');
+  Serial.print(coinCalSamples + 1);
+  Serial.print(',');
+  Serial.println(coinCalK);
+  Serial.print(F("Insert ")); Serial.print(coinTable[coinCalRow].peso);
+  Serial.println(F(" Peso coin..."));
+}
 
-  coinPulseCount = 0;
-  Serial.println(F("Insert 10 Peso coin..."));
-  waitForCoinPulse();
-  coin10P_pulses = coinPulseCount;
-  EEPROM.put(8, coin10P_pulses);
-  Serial.print(F("P10 coin: ")); Serial.print(coin10P_pulses); Serial.println(F(" pulses"));
+void handleCoinCal() {
+  if (coinCalActive && millis() - coinCalStepMs > COINCAL_TIMEOUT_MS) {
+    Serial.println(F("COINCAL_TIMEOUT"));
+    abortCoinCal();
+  }
+}
 
-  Serial.println(F("Coin calibration saved to EEPROM."));
+void abortCoinCal() {
+  coinCalActive = false;
+  Serial.println(F("Calibration aborted, coin table unchanged."));
 }
 
-void waitForCoinPulse() {
-  unsigned long start = millis();
-  while (millis() - start < 15000) { // 15 second timeout
-    if (coinPulseCount > 0 && millis() - lastCoinPulseTime > COIN_TIMEOUT_MS) {
-      Serial.print(F("Detected: ")); Serial.print(coinPulseCount); Serial.println(F(" pulses"));
-      return;
+void coinCalSample(uint8_t pulses, const CoinTiming& t) {
+  lastActivity = millis();
+  if (coinCalSamples == 0 || pulses < coinCalMin[coinCalRow]) coinCalMin[coinCalRow] = pulses;
+  if (coinCalSamples == 0 || pulses > coinCalMax[coinCalRow]) coinCalMax[coinCalRow] = pulses;
+  coinCalSamples++;
+
+  timingMerge(coinCalTiming, t);
+  timingMerge(coinCalAll, t);
+
+  Serial.print(F("Detected: ")); Serial.print(pulses); Serial.println(F(" pulses"));
+  if (coinCalSamples < coinCalK) {
+    promptCoinCal();
+    return;
+  }
+  reportCoinCalRow();
+  nextCoinCalRow();
+}
+
+void timingMerge(CoinTiming& a, const CoinTiming& t) {
+  if (t.widthN > 0) {
+    if (a.widthN == 0 || t.widthMin < a.widthMin) a.widthMin = t.widthMin;
+    if (a.widthN == 0 || t.widthMax > a.widthMax) a.widthMax = t.widthMax;
+    a.widthSum += t.widthSum;
+    a.widthN += t.widthN;
+  }
+  if (t.periodN > 0) {
+    if (a.periodN == 0 || t.periodMin < a.periodMin) a.periodMin = t.periodMin;
+    if (a.periodN == 0 || t.periodMax > a.periodMax) a.periodMax = t.periodMax;
+    a.periodSum += t.periodSum;
+    a.periodN += t.periodN;
+  }
+}
+
+// COINCAL_ROW:peso,n,minCount,maxCount,width mean/min/max,period mean/min/max (ms)
+void reportCoinCalRow() {
+  const CoinTiming& a = coinCalTiming;
+  Serial.print(F("COINCAL_ROW:"));
+  Serial.print(coinTable[coinCalRow].peso);
+  Serial.print(',');
+  Serial.print(coinCalSamples);
+  Serial.print(',');
+  Serial.print(coinCalMin[coinCalRow]);
+  Serial.print(',');
+  Serial.print(coinCalMax[coinCalRow]);
+  Serial.print(',');
+  Serial.print(a.widthN ? a.widthSum / 10.0 / a.widthN : 0.0, 1);
+  Serial.print(',');
+  Serial.print(a.widthMin / 10.0, 1);
+  Serial.print(',');
+  Serial.print(a.widthMax / 10.0, 1);
+  Serial.print(',');
+  Serial.print(a.periodN ? a.periodSum / 10.0 / a.periodN : 0.0, 1);
+  Serial.print(',');
+  Serial.print(a.periodMin / 10.0, 1);
+  Serial.print(',');
+  Serial.println(a.periodMax / 10.0, 1);
+}
+
+void skipCoinCalRow() {
+  if (!coinCalActive) return;
+  coinCalMin[coinCalRow] = coinCalMax[coinCalRow] = 0;
+  Serial.print(F("COINCAL_SKIPPED:"));
+  Serial.println(coinTable[coinCalRow].peso);
+  nextCoinCalRow();
+}
+
+void nextCoinCalRow() {
+  if (++coinCalRow < coinTableCount) {
+    beginCoinCalRow();
+    return;
+  }
+  coinCalActive = false;
+  finishCoinCal();
+}
+
+// Observed ranges, plus a margin where it stays short of the midpoint to
+// the neighbouring coin; skipped rows keep their current window
+void finishCoinCal() {
+  CoinEntry t[COIN_TABLE_MAX];
+  memcpy(t, coinTable, sizeof(t));
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    if (coinCalMax[i] == 0) continue;
+    t[i].minPulses = coinCalMin[i];
+    t[i].maxPulses = coinCalMax[i];
+  }
+  if (!coinTableValid(t, coinTableCount)) {
+    Serial.println(F("COINCAL_ERROR:OVERLAP"));
+    Serial.println(F("Two coins gave overlapping pulse counts; calibration not saved."));
+    return;
+  }
+
+  uint8_t lo[COIN_TABLE_MAX], hi[COIN_TABLE_MAX];
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    lo[i] = max(t[i].minPulses - COINCAL_MARGIN, 1);
+    hi[i] = min(t[i].maxPulses + COINCAL_MARGIN, COIN_PULSES_MAX);
+    for (uint8_t j = 0; j < coinTableCount; j++) {
+      if (j == i) continue;
+      if (t[j].maxPulses < t[i].minPulses) lo[i] = max(lo[i], (uint8_t)((t[j].maxPulses + t[i].minPulses) / 2 + 1));
+      if (t[j].minPulses > t[i].maxPulses) hi[i] = min(hi[i], (uint8_t)((t[i].maxPulses + t[j].minPulses) / 2));
     }
-    delay(100);
   }
-  Serial.println(F("Timeout. No coin detected."));
+  for (uint8_t i = 0; i < coinTableCount; i++) {
+    if (coinCalMax[i] == 0) continue;
+    t[i].minPulses = lo[i];
+    t[i].maxPulses = hi[i];
+  }
+  if (!coinTableValid(t, coinTableCount)) {
+    Serial.println(F("COINCAL_ERROR:OVERLAP"));
+    return;
+  }
+
+  memcpy(coinTable, t, sizeof(t));
+
+  // The acceptor times its pulses the same for every coin
+  if (coinCalAll.widthN > 0 && coinCalAll.periodN > 0) {
+    coinSignature.widthMin = coinCalAll.widthMin;
+    coinSignature.widthMax = coinCalAll.widthMax;
+    coinSignature.periodMin = coinCalAll.periodMin;
+    coinSignature.periodMax = coinCalAll.periodMax;
+    showSignature();
+  }
+  saveConfig();
+  Serial.println(F("COINCAL_DONE"));
+  showCoinTable();
+  Serial.println(F("Coin calibration saved to EEPROM."));
 }
 
 void calibrateFlow() {
   Serial.println(F("=== FLOW CALIBRATION ==="));
   Serial.println(F("Collect exactly 1000 ml and type DONE when ready."));
 
-  flowPulseCount = 0;
-  digitalWrite(PUMP_PIN, HIGH);
-  digitalWrite(VALVE_PIN, HIGH);
+  unsigned long pulses, ms;
+  if (!runCalibrationPour(pulses, ms) || pulses == 0) {
+    Serial.println(F("Calibration aborted, keeping previous value."));
+    return;
+  }
+
+  // Keep the curve shape: the pour ran at one frequency on that curve
+  uint16_t freqX10 = (uint16_t)min(pulses * 10000UL / max(ms, 1UL), 65535UL);
+  float curveK = kFactorAt(freqX10) / pulsesPerLiter;
+  pulsesPerLiter = pulses / curveK;
+  if (pulsesPerLiter < PPL_MIN || pulsesPerLiter > PPL_MAX) pulsesPerLiter = PPL_DEFAULT;
+  saveConfig();
+  autoCalReset();
 
+  Serial.print(F("New calibration saved: "));
+  Serial.print(pulsesPerLiter);
+  Serial.println(F(" pulses per liter."));
+}
+
+// Guided multi-rate calibration: one pour per flow restrictor setting,
+// lowest flow first. Fills the flow curve and rescales pulsesPerLiter.
+void calibrateFlowCurve() {
+  Serial.println(F("=== FLOW CURVE CALIBRATION ==="));
+  Serial.print(F("For each step set the flow restrictor, collect exactly "));
+  Serial.print(FLOWCAL_POINT_ML);
+  Serial.println(F(" ml and type DONE, or SKIP. Go from lowest to highest flow."));
+
+  uint16_t freqs[FLOWCURVE_POINTS];
+  uint16_t ks[FLOWCURVE_POINTS];
+  uint8_t n = 0;
+  for (uint8_t step = 0; step < FLOWCURVE_POINTS; step++) {
+    Serial.print(F("FLOWCAL_STEP:"));
+    Serial.println(step + 1);
+
+    unsigned long pulses, ms;
+    if (!runCalibrationPour(pulses, ms) || pulses == 0 || ms == 0) continue;
+
+    uint16_t freqX10 = (uint16_t)min(pulses * 10000UL / ms, 65535UL);
+    uint16_t k = (uint16_t)min(pulses * 1000UL / FLOWCAL_POINT_ML, 65535UL);
+    if (k < PPL_MIN || k > PPL_MAX) {
+      Serial.println(F("Point out of range, skipped."));
+      continue;
+    }
+
+    // Insert sorted by frequency
+    uint8_t i = n;
+    while (i > 0 && freqs[i - 1] > freqX10) {
+      freqs[i] = freqs[i - 1];
+      ks[i] = ks[i - 1];
+      i--;
+    }
+    freqs[i] = freqX10;
+    ks[i] = k;
+    n++;
+
+    Serial.print(F("FLOWCAL_POINT:"));
+    Serial.print(freqX10);
+    Serial.print(F(","));
+    Serial.println(k);
+  }
+
+  if (n == 0) {
+    Serial.println(F("No points collected, curve unchanged."));
+    return;
+  }
+
+  // Nominal K is the mean; the curve holds each point relative to it
+  unsigned long sum = 0;
+  for (uint8_t i = 0; i < n; i++) sum += ks[i];
+  pulsesPerLiter = (float)sum / n;
+
+  flowCurve.magic = FLOWCURVE_MAGIC;
+  flowCurve.count = n;
+  for (uint8_t i = 0; i < n; i++) {
+    flowCurve.freqX10[i] = freqs[i];
+    flowCurve.factorQ10[i] = (uint16_t)(((uint32_t)ks[i] << 10) / (uint32_t)pulsesPerLiter);
+  }
+  saveConfig();
+  autoCalReset();
+
+  Serial.print(F("Flow curve saved: "));
+  Serial.print(n);
+  Serial.print(F(" points, nominal "));
+  Serial.print(pulsesPerLiter);
+  Serial.println(F(" pulses per liter."));
+}
+
+// Runs the pump until a DONE line (returns true), a SKIP line or the
+// 2 minute timeout. Other lines are ignored, so Pi traffic such as
+// STATUS cannot end the step.
+bool runCalibrationPour(unsigned long& pulses, unsigned long& ms) {
+  unsigned long startCount = flowPulseCount;
+  setPumpValve(true);
+
+  bool done = false;
+  bool skipped = false;
+  char line[8];
+  uint8_t len = 0;
+  bool overflow = false;
   unsigned long startTime = millis();
+  unsigned long lastUpdate = startTime;
   while (millis() - startTime < 120000) { // 2 minute timeout
-    if (Serial.available()) {
+    while (Serial.available()) {
       char c = Serial.read();
-      if (c == 'D' || c == 'd') {
-        // Check for "DONE"
-        delay(10); // Wait for rest of characters
-        while (Serial.available()) Serial.read(); // Clear buffer
-        break;
+      if (c == '\n' || c == '\r') {
+        line[len] = '\0';
+        if (!overflow && len > 0) {
+          if (strcasecmp(line, "DONE") == 0) done = true;
+          else if (strcasecmp(line, "SKIP") == 0) skipped = true;
+        }
+        len = 0;
+        overflow = false;
+        if (done || skipped) break;
+      } else if (len < sizeof(line) - 1) {
+        line[len++] = c;
+      } else {
+        overflow = true;
       }
     }
+    if (done || skipped) break;
     // Show progress every 2 seconds
-    static unsigned long lastUpdate = 0;
     if (millis() - lastUpdate > 2000) {
-      Serial.print(F("Current pulses: ")); Serial.println(flowPulseCount);
+      Serial.print(F("Current pulses: ")); Serial.println(flowPulseCount - startCount);
       lastUpdate = millis();
     }
     delay(100);
   }
 
-  digitalWrite(PUMP_PIN, LOW);
-  digitalWrite(VALVE_PIN, LOW);
-
-  pulsesPerLiter = flowPulseCount;
-  EEPROM.put(12, pulsesPerLiter);
+  setPumpValve(false);
 
-  Serial.print(F("New calibration saved: "));
-  Serial.print(pulsesPerLiter);
-  Serial.println(F(" pulses per liter."));
+  pulses = flowPulseCount - startCount;
+  ms = millis() - startTime;
+  return done;
 }
 
 // ---------------- TEST FUNCTION ----------------
@@ -602,17 +2786,24 @@ void testCoinPatterns() {
   unsigned long startTime = millis();
   while (millis() - startTime < 60000) { // Run for 60 seconds
     if (coinPulseCount > 0 && (millis() - lastCoinPulseTime > COIN_TIMEOUT_MS)) {
-      uint8_t pulses = coinPulseCount;
-      coinPulseCount = 0;
+      CoinTiming timing;
+      uint8_t pulses = takeCoinTrain(timing);
       
       Serial.print(F("TEST: Detected "));
       Serial.print(pulses);
-      Serial.println(F(" pulses"));
+      Serial.print(F(" pulses, width "));
+      Serial.print(timing.widthN ? timing.widthSum / 10.0 / timing.widthN : 0.0, 1);
+      Serial.print(F(" ms, period "));
+      Serial.print(timing.periodN ? timing.periodSum / 10.0 / timing.periodN : 0.0, 1);
+      Serial.println(F(" ms"));
       
       // Try to identify the coin
-      if (pulses == 1) Serial.println(F("TEST: This appears to be a P1 coin"));
-      else if (pulses == 5) Serial.println(F("TEST: This appears to be a P5 coin"));
-      else if (pulses == 10) Serial.println(F("TEST: This appears to be a P10 coin"));
+      const CoinEntry* coin = findCoinByPulses(pulses);
+      if (coin) {
+        Serial.print(F("TEST: This appears to be a P"));
+        Serial.print(coin->peso);
+        Serial.println(F(" coin"));
+      }
       else Serial.println(F("TEST: Unknown coin pattern"));
     }
     
@@ -629,20 +2820,23 @@ void testCoinPatterns() {
 // ---------------- RESET ----------------
 void resetSystem() {
   creditML = 0;
-  chargeSeconds = 0;
+  resetWallets();
   dispensing = false;
-
-  coinInputEnabled = true;
-  coinPulseCount = 0;
+  cupRemovedFlag = false;
+  pendingCreditML = 0;
+  awaitCupClear = false;
+  clearOrders();
+
+  // A reset frees no outbox slots; keep refusing coins while it is full
+  coinInputEnabled = !outboxFull();
+  coinCalActive = false;
+  dropCoinTrain();
   
   // Clear coin blocking
   blockAllCoins = false;
   coinBlockUntil = 0;
 
-  digitalWrite(PUMP_PIN, LOW);
-  digitalWrite(VALVE_PIN, LOW);
-
-  attachInterrupt(digitalPinToInterrupt(COIN_PIN), coinISR, FALLING);
+  setPumpValve(false);
 
   Serial.println(F("System reset."));
   lastActivity = millis();
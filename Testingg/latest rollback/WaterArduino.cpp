@@ -25,7 +25,7 @@
 
 // ---------------- GLOBAL VARIABLES ----------------
 int currentMode = WATER_MODE; // Default mode (Pi can change this)
-float pulsesPerLiter = 4305.0; // Flow calibration (YF-S201 ~450/L)
+float pulsesPerLiter = 450.0;  // Flow calibration (YF-S201 ~450/L)
 
 // Coin settings (EEPROM stored)
 int coin1P_pulses = 1;
@@ -86,7 +86,8 @@ void setup() {
   EEPROM.get(8, coin10P_pulses);
   EEPROM.get(12, pulsesPerLiter);
 
-  if (isnan(pulsesPerLiter) || pulsesPerLiter < 200 || pulsesPerLiter > 1000)
+  // Same sanity range as arduinocode.ino, which shares offset 12
+  if (isnan(pulsesPerLiter) || pulsesPerLiter < 200 || pulsesPerLiter > 10000)
     pulsesPerLiter = 450.0;
 
   // Initialize cup detection variables
@@ -1,37 +1,161 @@
+import os
+import struct
+import sys
+import tempfile
+import types
 import unittest
-from arduino_listener import ArduinoListener
 
-class ParseTests(unittest.TestCase):
+# The parser tests never open a port; let them run without pyserial
+try:
+    import serial  # noqa: F401
+except ImportError:
+    _serial = types.ModuleType("serial")
+    _serial.Serial = object
+    _serial.SerialException = OSError
+    sys.modules["serial"] = _serial
+
+import ArduinoListener as listener_module
+from ArduinoListener import ArduinoListener, JOURNAL_RECORD
+from timer_status import decode_timer_status
+
+
+class FakeSerial:
+    """Captures commands written to the Arduino and serves canned reads."""
+
+    def __init__(self, data=b""):
+        self.is_open = True
+        self.written = []
+        self.data = data
+
+    def write(self, raw):
+        self.written.append(raw.decode().strip())
+
+    def read(self, size):
+        chunk, self.data = self.data[:size], self.data[size:]
+        return chunk
+
+
+class ListenerTestCase(unittest.TestCase):
     def setUp(self):
-        self.l = ArduinoListener(simulate=True)
+        self.tmp = tempfile.TemporaryDirectory()
+        self.seen_file = os.path.join(self.tmp.name, "seen.json")
+        self._old_seen_file = listener_module.SEEN_EVENTS_FILE
+        listener_module.SEEN_EVENTS_FILE = self.seen_file
+
+        self.events = []
+        self.reply = None
+        self.l = ArduinoListener(event_callback=self._callback)
+        self.l.ser = FakeSerial()
+
+    def tearDown(self):
+        listener_module.SEEN_EVENTS_FILE = self._old_seen_file
+        self.tmp.cleanup()
+
+    def _callback(self, event, value):
+        self.events.append((event, value))
+        return self.reply
+
+    def acks(self):
+        return [c for c in self.l.ser.written if c.startswith("ACK:")]
+
 
+class ParseTests(ListenerTestCase):
     def test_coin_parsing(self):
-        ev = self.l._parse_line('Coin detected, new credit: 250 ml')
-        self.assertEqual(ev['event'], 'COIN_INSERTED')
-        self.assertEqual(ev['volume_ml'], 250)
+        self.l._process_line("COIN:5")
+        self.assertEqual(self.events, [("coin", 5)])
 
-    def test_credit_parsing(self):
-        ev = self.l._parse_line('CREDIT_ML: 300')
-        self.assertEqual(ev['event'], 'CREDIT_UPDATE')
-        self.assertEqual(ev['credit_ml'], 300)
+    def test_invalid_coin_ignored(self):
+        self.l._process_line("COIN:3")
+        self.assertEqual(self.events, [])
 
-    def test_dispensing_done(self):
-        ev = self.l._parse_line('Dispensing complete. Total: 250.3 ml')
-        self.assertEqual(ev['event'], 'DISPENSING_DONE')
-        self.assertAlmostEqual(ev['total_ml'], 250.3)
+    def test_progress_frame(self):
+        self.l._process_line("DP:1253,84,65535")
+        event, value = self.events[0]
+        self.assertEqual(event, "dispense_progress")
+        self.assertAlmostEqual(value["dispensed_ml"], 125.3)
+        self.assertAlmostEqual(value["flow_ml_s"], 8.4)
+        self.assertIsNone(value["eta_seconds"])
 
-    def test_flow_pulses(self):
-        ev = self.l._parse_line('FLOW_PULSES: 45')
-        self.assertEqual(ev['event'], 'FLOW_PULSES')
-        self.assertEqual(ev['pulses'], 45)
+    def test_animation_start(self):
+        self.l._process_line("ANIMATION_START:250ml,30s")
+        self.assertEqual(self.events, [("animation_start", {"total_ml": 250, "total_seconds": 30})])
 
-    def test_cup_detect(self):
-        ev = self.l._parse_line('Cup detected. Starting dispense...')
-        self.assertEqual(ev['event'], 'CUP_DETECTED')
+    def test_coin_debug_lines_not_dispatched(self):
+        self.l._process_line("WATER Coin accepted: P5, added=250 ml, total=250 ml")
+        self.l._process_line("DEBUG: Received 5 pulses")
+        self.assertEqual(self.events, [])
+
+    def test_resync_reply_not_dispatched(self):
+        self.l._process_line("RESYNC:3")
+        self.assertEqual(self.events, [])
 
     def test_unknown_falls_back(self):
-        ev = self.l._parse_line('Hello world')
-        self.assertEqual(ev['event'], 'RAW')
+        self.l._process_line("Hello world")
+        self.assertEqual(self.events, [])
+
+
+class JournalTests(ListenerTestCase):
+    def payload(self, records, corrupt=False):
+        body = bytes([len(records), JOURNAL_RECORD.size])
+        for r in records:
+            body += JOURNAL_RECORD.pack(*r)
+        checksum = 0
+        for b in body:
+            checksum ^= b
+        return body + bytes([checksum ^ (1 if corrupt else 0)])
+
+    def test_parse_journal(self):
+        rec = (250, 1120, 84, 95, 88, -3, 450, 0, 7)
+        records = self.l._parse_journal(self.payload([rec, rec]))
+        self.assertEqual(len(records), 2)
+        self.assertEqual(records[0]["target_ml"], 250)
+        self.assertEqual(records[0]["overshoot_pulses"], -3)
+        self.assertEqual(records[1]["seq"], 7)
+
+    def test_bad_checksum_rejected(self):
+        with self.assertRaises(ValueError):
+            self.l._parse_journal(self.payload([(1, 2, 3, 4, 5, 6, 7, 0, 1)], corrupt=True))
+
+    def test_journal_bin_line_reads_payload(self):
+        data = self.payload([(500, 2240, 120, 90, 85, 2, 450, 1, 3)])
+        self.l.ser = FakeSerial(data + b"\n")
+        self.l._process_line(f"JOURNAL_BIN:{len(data)}")
+        event, records = self.events[0]
+        self.assertEqual(event, "journal")
+        self.assertEqual(records[0]["target_ml"], 500)
+
+
+class TimerStatusTests(unittest.TestCase):
+    def frame(self, remaining, slot_count=None, corrupt=False):
+        if slot_count is None:
+            slot_count = len(remaining)
+        payload = struct.pack("<HBHHHH", 7, slot_count, 0b0101, 0b0100, 1200, 850)
+        payload += struct.pack(f"<{len(remaining)}H", *remaining)
+        checksum = 0
+        for b in payload:
+            checksum ^= b
+        return payload + bytes([checksum ^ (1 if corrupt else 0)])
+
+    def test_decode_status(self):
+        status = decode_timer_status(self.frame([3600, 0, 90, 0]))
+        self.assertEqual(status["version"], 7)
+        self.assertEqual(status["active"], [True, False, True, False])
+        self.assertEqual(status["paused"], [False, False, True, False])
+        self.assertEqual(status["remaining"], [3600, 0, 90, 0])
+        self.assertEqual((status["loops_per_s"], status["loop_max_us"]), (1200, 850))
+
+    def test_bad_checksum_rejected(self):
+        with self.assertRaises(ValueError):
+            decode_timer_status(self.frame([1, 2, 3, 4], corrupt=True))
+
+    def test_length_must_match_slot_count(self):
+        with self.assertRaises(ValueError):
+            decode_timer_status(self.frame([1, 2, 3], slot_count=4))
+
+    def test_short_frame_rejected(self):
+        with self.assertRaises(ValueError):
+            decode_timer_status(self.frame([])[:5])
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,50 @@
+import json
+import unittest
+
+from test_arduino_listener import ListenerTestCase  # stubs pyserial first
+import ArduinoListener as listener_module
+from ArduinoListener import ArduinoListener
+
+
+class EpochTests(ListenerTestCase):
+    def test_new_epoch_restarts_seq(self):
+        self.l._process_line("EVT:1,5,250,1,0,0,4242")
+        self.l._process_line("EVT:1,5,250,1,0,0,777")
+        self.assertEqual(len(self.events), 2)
+
+    def test_legacy_event_is_epoch_zero(self):
+        self.l._process_line("EVT:2,1,50,1,0,0")
+        self.assertTrue(self.l._event_seen(0, 2))
+
+
+class DedupeTests(ListenerTestCase):
+    def test_seen_events_persist(self):
+        self.assertTrue(self.l._mark_event_seen(4242, 5))
+        self.assertFalse(self.l._mark_event_seen(4242, 5))
+        with open(self.seen_file) as f:
+            self.assertEqual(json.load(f), [[4242, 5]])
+        self.assertTrue(ArduinoListener()._event_seen(4242, 5))
+
+    def test_legacy_seen_file_loads_as_epoch_zero(self):
+        with open(self.seen_file, "w") as f:
+            json.dump([3, 4], f)
+        l = ArduinoListener()
+        self.assertTrue(l._event_seen(0, 4))
+        self.assertFalse(l._event_seen(4242, 4))
+
+    def test_counter_reset_within_epoch_clears_it(self):
+        self.l._mark_event_seen(1, 500)
+        self.l._mark_event_seen(2, 3)
+        self.l._mark_event_seen(1, 3)
+        self.assertFalse(self.l._event_seen(1, 500))
+        self.assertTrue(self.l._event_seen(2, 3))
+
+    def test_seen_list_bounded(self):
+        for seq in range(listener_module.SEEN_EVENTS_KEEP + 10):
+            self.l._mark_event_seen(1, seq)
+        self.assertEqual(len(self.l._seen_event_seqs), listener_module.SEEN_EVENTS_KEEP)
+        self.assertFalse(self.l._event_seen(1, 0))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,49 @@
+import unittest
+
+from test_arduino_listener import ListenerTestCase
+
+
+class EventTests(ListenerTestCase):
+    def test_coin_event_acked_after_dispatch(self):
+        self.l._process_line("EVT:7,5,250,1,0,3,4242")
+        self.assertEqual(self.events, [("coin", 5)])
+        self.assertEqual(self.acks(), ["ACK:7"])
+
+    def test_plain_coin_line_skipped_once_outbox_seen(self):
+        self.l._process_line("EVT:7,5,250,1,0,3,4242")
+        self.l._process_line("COIN:5")
+        self.assertEqual(len(self.events), 1)
+
+    def test_duplicate_acked_not_dispatched(self):
+        self.l._process_line("EVT:7,5,250,1,0,3,4242")
+        self.l._process_line("EVT:7,5,250,1,0,3,4242")
+        self.assertEqual(len(self.events), 1)
+        self.assertEqual(self.acks(), ["ACK:7", "ACK:7"])
+
+    def test_standalone_sale_not_acked_until_booked(self):
+        self.l._process_line("EVT:9,10,400,0,1,65535,4242")
+        self.assertEqual(self.events[0][0], "standalone_sale")
+        self.assertEqual(self.acks(), [])
+
+        # Resent by the Arduino; this time the UI books it
+        self.reply = True
+        self.l._process_line("EVT:9,10,400,0,1,65535,4242")
+        self.assertEqual(len(self.events), 2)
+        sale = self.events[1][1]
+        self.assertEqual((sale["epoch"], sale["seq"], sale["coin"], sale["ml"]), (4242, 9, 10, 400))
+        self.assertIsNone(sale["timestamp"])
+        self.assertEqual(self.acks(), ["ACK:9"])
+
+    def test_failed_coin_handler_not_acked(self):
+        self.reply = False
+        self.l._process_line("EVT:3,1,50,1,0,0,4242")
+        self.assertEqual(self.acks(), [])
+
+    def test_malformed_event_ignored(self):
+        self.l._process_line("EVT:2,x,50")
+        self.assertEqual(self.events, [])
+        self.assertEqual(self.acks(), [])
+
+
+if __name__ == '__main__':
+    unittest.main()
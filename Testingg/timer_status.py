@@ -0,0 +1,34 @@
+"""
+Decoder for the timer board's binary STATUS_BIN frame (sendStatusFrame in
+timermodule.ino). Kept apart from the UI so it can be tested without
+Tk or Firebase.
+"""
+import struct
+
+
+def decode_timer_status(data):
+    """Decode a timer board STATUS_BIN payload (see sendStatusFrame in timermodule.ino).
+
+    data is the payload plus its trailing XOR checksum byte.
+    """
+    if len(data) < 12:
+        raise ValueError("status frame too short")
+    payload, checksum = data[:-1], data[-1]
+    x = 0
+    for b in payload:
+        x ^= b
+    if x != checksum:
+        raise ValueError("status frame checksum mismatch")
+    version, slot_count, active, paused, loops, loop_max = struct.unpack_from("<HBHHHH", payload)
+    if len(payload) != 11 + 2 * slot_count:
+        raise ValueError("status frame length does not match slot count")
+    remaining = struct.unpack_from(f"<{slot_count}H", payload, 11)
+    return {
+        "version": version,
+        "slot_count": slot_count,
+        "active": [bool(active >> i & 1) for i in range(slot_count)],
+        "paused": [bool(paused >> i & 1) for i in range(slot_count)],
+        "loops_per_s": loops,
+        "loop_max_us": loop_max,
+        "remaining": list(remaining),
+    }
@@ -1,74 +1,385 @@
 // timer_display_4slot.ino
 // Enhanced version with improved functionality
-// Controls 4 independent 7-segment displays
+// Controls independent 7-segment displays, one per slot (SLOT_COUNT)
 
 #include <TM1637Display.h>
+#include <EEPROM.h>
 
-// Define pins for each display
-#define CLK_1 2
-#define DIO_1 3
-#define CLK_2 4
-#define DIO_2 5
-#define CLK_3 6
-#define DIO_3 7
-#define CLK_4 8
-#define DIO_4 9
-
-TM1637Display display1(CLK_1, DIO_1);
-TM1637Display display2(CLK_2, DIO_2);
-TM1637Display display3(CLK_3, DIO_3);
-TM1637Display display4(CLK_4, DIO_4);
-
-TM1637Display* displays[4] = {&display1, &display2, &display3, &display4};
-
-// Custom segment patterns
-const uint8_t SEG_DASH[] = {
-    SEG_G  // Just the middle segment for dash
+// Slot count and display wiring. All displays share one CLK line and
+// each slot has its own DIO. Boards wired with a CLK per display list it
+// per slot instead. Each slot also needs an analog input for its ACS712,
+// and the Nano has eight (A0..A7), so it tops out at 8 slots.
+constexpr uint8_t SLOT_COUNT = 4;
+
+struct DisplayPins {
+  uint8_t clk;
+  uint8_t dio;
 };
-const uint8_t SEG_DASH2[] = {
-    SEG_G,
-    SEG_G  // Two dashes
+
+// *** WIRING MIGRATION ***
+// Boards built before SLOT_COUNT have one CLK per display: CLK/DIO on
+// D2/D3, D4/D5, D6/D7 and D8/D9. The shared-CLK default below is NOT
+// that wiring; flashing it onto an old board leaves displays 2-4 blank
+// (and drives an old CLK line as DIO). Either rewire the CLKs to D2 and
+// the DIOs to D3..D6, or swap in the per-display table underneath.
+constexpr DisplayPins DISPLAY_PINS[SLOT_COUNT] = {
+  {2, 3}, {2, 4}, {2, 5}, {2, 6}
 };
-const uint8_t SEG_ERR[] = {
+// Per-display CLK (original wiring):
+// constexpr DisplayPins DISPLAY_PINS[SLOT_COUNT] = {
+//   {2, 3}, {4, 5}, {6, 7}, {8, 9}
+// };
+
+// ACS712 output for each slot, on the Nano's analog inputs (A0..A7)
+constexpr uint8_t SENSE_PINS[SLOT_COUNT] = {A0, A1, A2, A3};
+
+static_assert(SLOT_COUNT >= 1 && SLOT_COUNT <= 8, "SLOT_COUNT must be 1-8 (one analog input per slot)");
+static_assert(sizeof(DISPLAY_PINS) / sizeof(DISPLAY_PINS[0]) == SLOT_COUNT,
+              "DISPLAY_PINS needs one entry per slot");
+static_assert(sizeof(SENSE_PINS) == SLOT_COUNT,
+              "SENSE_PINS needs one entry per slot");
+
+// No more than this many bus transactions are made per loop pass, so
+// refresh cost stays flat as SLOT_COUNT grows (see flushDisplays)
+constexpr uint8_t FLUSH_BUDGET = 4;
+
+// Library objects are only used for TEST and as the BENCH baseline; the
+// normal refresh goes through the direct-port driver below.
+TM1637Display* displays[SLOT_COUNT];
+
+// Direct-port TM1637 driver. Lines are open-drain like the library: the
+// PORT bit stays 0 and DDR switches between driving low and released
+// (module pull-up). Displays sharing a CLK pin with DIO lines on the same
+// port form one bus; CLK is clocked once per bit and every DIO on the
+// bus gets its own display's data bit in a single DDR write, so all those
+// slots update in one transaction.
+// Half bit time; the library uses 100 us. The lines are only pulled up by
+// the modules' resistors, and a shared CLK carries every module's input
+// plus the cable, so the edge is slow. 50 us leaves a wide margin; a build
+// whose rise time has been checked on a scope (10-90%, well under a tenth
+// of this) can lower it with -DTM_BIT_DELAY_US=<us>.
+#ifndef TM_BIT_DELAY_US
+#define TM_BIT_DELAY_US 50
+#endif
+
+struct TmBus {
+  volatile uint8_t* clkDdr;
+  volatile uint8_t* dioDdr;
+  volatile uint8_t* dioIn;
+  uint8_t clkMask;
+  uint8_t clkPin;
+  uint8_t dioPort;
+};
+
+TmBus tmBuses[SLOT_COUNT];
+uint8_t tmBusCount = 0;
+uint8_t slotBus[SLOT_COUNT];      // Bus index for each slot
+uint8_t slotDioMask[SLOT_COUNT];  // DIO bit for each slot on its bus port
+uint8_t tmDisplayCtrl = 0x88 | 3; // Display on + brightness
+unsigned long tmNacks = 0;        // Bytes a display failed to acknowledge
+
+// Custom segment pattern for TEST, kept in flash
+const uint8_t SEG_ERR[] PROGMEM = {
     SEG_A | SEG_D | SEG_E | SEG_F | SEG_G,  // E
     SEG_E | SEG_G,                           // r
     SEG_E | SEG_G                            // r
 };
 
+// Per-slot state, kept as parallel arrays sized at compile time
 // Time remaining for each slot (in seconds)
-int slotTimes[4] = {0, 0, 0, 0};
-bool slotActive[4] = {false, false, false, false};
-bool blinkColon[4] = {true, true, true, true};
-bool slotPaused[4] = {false, false, false, false};
-unsigned long lastBlink[4] = {0, 0, 0, 0};
-unsigned long lastDecrement[4] = {0, 0, 0, 0};
+#define SLOT_SECONDS_MAX 32767   // slotTimes is a 16-bit int, as SLOTn: parses
+int slotTimes[SLOT_COUNT];
+bool slotActive[SLOT_COUNT];
+bool blinkColon[SLOT_COUNT];
+bool slotPaused[SLOT_COUNT];
+unsigned long lastBlink[SLOT_COUNT];
+
+// Countdown timekeeping. A running slot holds the millis() deadline at
+// which it reaches zero, a paused slot holds its frozen remaining time.
+// slotTimes[] is only the displayed value derived from these, so late
+// loop passes never lose time and the Pi does not need SYNC to correct
+// drift. millis() is driven by the Timer0 overflow interrupt.
+unsigned long slotDeadline[SLOT_COUNT];
+unsigned long slotRemainingMs[SLOT_COUNT];
+unsigned long slotAnchorMs[SLOT_COUNT];    // Remaining ms at last SLOT/SYNC
+uint8_t slotFlash[SLOT_COUNT];             // Completion flash phases left
+
+#define FLASH_PHASES 6       // Dash/blank pairs after COMPLETE
+#define FLASH_PHASE_MS 300
+
+// Drift statistics, gathered from SYNC corrections (see DRIFT command)
+unsigned int driftSyncs = 0;
+long driftLastMs = 0;
+long driftSumMs = 0;
+long driftMaxMs = 0;        // Largest absolute correction
+long driftPpm = 0;          // Rate implied by the last correction
+unsigned long driftLateMaxMs = 0;  // Worst delay showing a seconds tick
+
+// Shared time base with the Pi, set by the TIME: handshake. Pi time is
+// its monotonic clock in ms (mod 2^32); piOffset converts it to millis().
+// Deadline commands and timestamped PAUSE/RESUME are expressed in Pi time,
+// so the board works out exact remaining time itself and the Pi has
+// nothing to send between state changes.
+bool timeBaseSet = false;
+unsigned long piOffset = 0;        // Pi time minus millis()
+unsigned long timeBaseAt = 0;      // millis() of the last handshake
+
+// A larger handshake step is not drift but a new Pi clock (the Pi
+// rebooted): rebase onto it and leave the deadlines alone
+#define TIME_SLEW_MAX_MS 5000
+
+// Countdown checkpoints, so a reset or brownout does not blank every slot
+// until the Pi resends. Records rotate through the EEPROM below the sensor
+// zeros for wear leveling; EEPROM.put only rewrites bytes that changed.
+// A record is written shortly after a slot state change, once a minute
+// while a slot is running, and immediately when Vcc sags towards brownout.
+#define CKPT_EEPROM_ADDR   0
+#define CKPT_EEPROM_BYTES  ZERO_EEPROM_ADDR  // Sensor zeros sit above the ring
+#define ZERO_EEPROM_ADDR   984
+#define CKPT_MAGIC         0x55    // 'U', records now carry sessionMask
+#define CKPT_MIN_GAP_MS    2000    // Coalesce bursts of state changes
+#define CKPT_INTERVAL_MS   60000   // While any slot is running
+
+#define CKPT_CHANGE   1
+#define CKPT_PERIODIC 2
+#define CKPT_BROWNOUT 3
+
+struct CheckpointRecord {
+  uint8_t magic;
+  uint8_t reason;
+  uint16_t seq;
+  uint16_t activeMask;
+  uint16_t pausedMask;
+  uint16_t sessionMask;       // Slots under plug-detect control
+  unsigned long piStamp;      // Pi time when written, 0 without a time base
+  unsigned long remainingMs[SLOT_COUNT];
+  uint16_t crc;
+};
+
+constexpr uint8_t CKPT_RECORDS = CKPT_EEPROM_BYTES / sizeof(CheckpointRecord);
+
+uint16_t ckptSeq = 0;
+uint8_t ckptNext = 0;             // Record index written next
+bool ckptDue = false;
+unsigned long lastCheckpoint = 0;
+uint8_t restoredReason = 0;
+unsigned long restoredPiStamp = 0;
+
+// Vcc is measured against the 1.1 V bandgap; below VCC_LOW_MV the
+// checkpoint is flushed once, re-armed when Vcc recovers
+#define VCC_CHECK_MS  20
+#define VCC_LOW_MV    4400
+#define VCC_OK_MV     4600
+#define VCC_SETTLE    8       // Bandgap conversions per check, last one kept
+unsigned long lastVccCheck = 0;
+unsigned int vccMv = 0;
+bool brownoutFlushed = false;
+
+// ADC sampling engine. The ADC runs free (about 9.6k conversions/s) with
+// its interrupt cycling the slot sense pins; on request it inserts a
+// burst of bandgap conversions for the Vcc check. In free-running mode
+// the next conversion has already started when the interrupt fires, so
+// a result belongs to the channel selected two interrupts earlier
+// (adcPipe). The ISR only accumulates integer sums of d = counts - zero
+// and d^2; RMS is worked out per window in loop().
+#define ADC_VCC            0xFF
+#define SENSE_MAX_SAMPLES  4096   // Per window, keeps the d^2 sum in 32 bits
+
+uint8_t senseMux[SLOT_COUNT];             // ADMUX value per slot
+volatile uint8_t adcPipe[2];              // Result channel, running channel
+volatile uint8_t adcNextSlot = 0;
+volatile uint8_t vccSelect = 0;           // Bandgap conversions left to start
+volatile uint8_t vccRun = 0;              // Consecutive bandgap results
+volatile bool vccRequest = false;
+volatile bool vccReady = false;
+volatile uint16_t vccRaw = 0;
+
+volatile int16_t isrZero[SLOT_COUNT];     // Whole-count zero used by the ISR
+volatile int32_t isrSumD[SLOT_COUNT];
+volatile uint32_t isrSumSq[SLOT_COUNT];
+volatile uint16_t isrCount[SLOT_COUNT];
+
+// Plug detection from the ACS712s. Each SENSE_WINDOW_MS window gives an
+// RMS current per slot; a slot reads as plugged above plugMa and
+// unplugged below unplugMa (hysteresis), each held for PLUG_DEBOUNCE_MS.
+// The window spans whole mains cycles (6 at 60 Hz, 5 at 50 Hz): a partial
+// cycle would make a steady load read high or low depending on phase.
+// Loop lateness stretches it by a few ms, a small fraction of 100 ms.
+#define SENSE_WINDOW_MS     100
+#define SENSE_UA_PER_COUNT  26390   // ACS712-05B: 185 mV/A, 4.883 mV/count
+#define PLUG_DEBOUNCE_MS    200     // Two windows
+
+// Zero offsets in 1/16 ADC counts, measured by ZERO with nothing plugged
+// in (replacing the Pi's calibrate_zero) and kept at the top of EEPROM
+#define ZERO_MAGIC        0x5A    // 'Z'
+#define ZERO_WINDOWS      10      // 1 s of windows
+
+struct ZeroRecord {
+  uint8_t magic;
+  uint16_t zero16[SLOT_COUNT];
+  uint16_t crc;
+};
+
+static_assert(ZERO_EEPROM_ADDR + sizeof(ZeroRecord) <= 1024,
+              "ZeroRecord must fit in EEPROM");
+
+uint16_t sensorZero16[SLOT_COUNT];
+uint16_t zeroMask = 0;                // Slots being zeroed
+uint8_t zeroWindowsLeft = 0;
+int32_t zeroSum16[SLOT_COUNT];        // Window mean offsets, 1/16 counts
+
+uint16_t sensorMa[SLOT_COUNT];        // Latest window RMS
+int16_t sensorOffset16[SLOT_COUNT];   // Latest window mean minus zero
+unsigned int currentRateMs = 0;       // CURRENT publish interval, 0 = off
+unsigned long lastCurrentPublish = 0;
+bool senseHigh[SLOT_COUNT];           // Debounced plugged state
+unsigned long senseEdge[SLOT_COUNT];  // When the raw state first differed, 0 if not
+unsigned long lastSenseWindow = 0;
+
+uint16_t plugMa = 800;
+uint16_t unplugMa = 500;
+unsigned long idleTimeoutMs = 60000UL;  // Unplugged/never plugged -> end
+
+// Charging session per slot, run on the board from plug detection:
+// SESSION:n:s arms a paused countdown, plugging in runs it, unplugging
+// pauses it, and a slot left unplugged past idleTimeoutMs ends. Only
+// transitions are reported, as EVT frames.
+// NOTE: inactive in the current kiosk. UI-HD_charge_detection.py still
+// runs plug detection on the Pi's own ACS712 readings and never sends
+// SESSION, so every slot stays SESS_NONE and counts down as before.
+#define SESS_NONE      0   // Plain countdown, no plug control
+#define SESS_ARMED     1   // Waiting for the first plug-in
+#define SESS_CHARGING  2
+#define SESS_UNPLUGGED 3
+
+uint8_t sessState[SLOT_COUNT];
+unsigned long sessSince[SLOT_COUNT];  // millis() of the last transition
+
+// Alert schedule, settable per slot with ALERTS:n:... Each threshold
+// fires once as the countdown crosses it; the final countdown fires every
+// second from alertFinal down to 1.
+#define ALERT_MAX 4
+const uint16_t ALERT_DEFAULTS[ALERT_MAX] PROGMEM = {300, 60, 30, 10};
+#define ALERT_FINAL_DEFAULT 5
+
+uint16_t alertAt[SLOT_COUNT][ALERT_MAX];  // Seconds, 0 = unused
+uint8_t alertFinal[SLOT_COUNT];
+
+// Slot event queue. Alerts and completions are queued from the countdown
+// path and sent from loop() one frame at a time, only when the serial TX
+// buffer has room, so output never stalls the display refresh. A queued
+// event that has not gone out yet absorbs the same event from other
+// slots, so slots crossing a threshold together produce one frame:
+//   EVT:<seq>,ALERT,<seconds>,<slot>[+<slot>...]
+//   EVT:<seq>,COMPLETE,0,<slot>[+<slot>...]
+//   EVT:<seq>,PLUGGED|UNPLUGGED|IDLE_END,<remaining s>,<slot>
+// With EVTACK:ON each frame is resent until the Pi replies ACK:<seq>.
+#define EVT_QUEUE_SIZE 8
+#define EVT_RETRY_MS   2000
+#define EVT_FRAME_MAX  48      // Worst-case frame length, in bytes
+
+#define EVT_ALERT     1
+#define EVT_COMPLETE  2
+#define EVT_PLUGGED   3    // value = remaining seconds
+#define EVT_UNPLUGGED 4
+#define EVT_IDLE_END  5
+
+struct SlotEvent {
+  uint16_t seq;
+  uint16_t value;
+  uint16_t slots;              // Bit per slot
+  uint8_t kind;
+  bool sent;
+  unsigned long sentAt;
+};
+
+SlotEvent evtQueue[EVT_QUEUE_SIZE];  // Oldest first
+uint8_t evtCount = 0;
+uint16_t evtSeq = 0;
+bool evtAckMode = false;
+unsigned int evtDropped = 0;
+
+// Status/heartbeat frame, replacing the READY line. Sent when the state
+// version changes (any slot start/stop/pause/resume) or every
+// HEARTBEAT_MS, whichever comes first. See sendStatusFrame() for layout.
+#define HEARTBEAT_MS 5000
+uint16_t stateVersion = 0;
+uint16_t sentVersion = 0;
+
 unsigned long lastHeartbeat = 0;
 int brightness = 3;  // 0-7
 
+// Segment framebuffer: updateDisplay() only renders into frame[], and
+// flushDisplays() sends the digits that differ from what the display
+// already shows. The digits change once per second and the colon every
+// 500 ms, so most loop passes write nothing at all.
+const uint8_t DIGIT_SEGMENTS[10] PROGMEM = {
+  0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F
+};
+#define SEG_COLON 0x80  // Colon is wired to bit 7 of digit 1
+
+uint8_t frame[SLOT_COUNT][4];  // Segments we want on each display
+uint8_t shown[SLOT_COUNT][4];  // Segments last written to each display
+bool shownValid[SLOT_COUNT];
+
+// Loop profiler, rolled over once per second (see PROFILE command)
+unsigned long profWindowStart = 0;
+unsigned long profLoops = 0;
+unsigned long profWrites = 0;      // TM1637 bus transactions
+unsigned long profDigits = 0;      // Digit bytes sent
+unsigned long profFlushUs = 0;
+unsigned long profLoopMaxUs = 0;
+unsigned long profLastLoops = 0;
+unsigned long profLastWrites = 0;
+unsigned long profLastDigits = 0;
+unsigned long profLastFlushUs = 0;
+unsigned long profLastLoopMaxUs = 0;
+
+// Wiring check for SENSE_PINS against DISPLAY_PINS. It sits here, after
+// the types, because the Arduino builder puts its function prototypes
+// ahead of the first function in the sketch.
+// True if sense pin s is neither a CLK nor a DIO from slot j onwards
+constexpr bool senseClear(uint8_t s, uint8_t j) {
+  return j == SLOT_COUNT ||
+         (SENSE_PINS[s] != DISPLAY_PINS[j].clk && SENSE_PINS[s] != DISPLAY_PINS[j].dio &&
+          senseClear(s, j + 1));
+}
+
+constexpr bool sensePinsFree(uint8_t s) {
+  return s == SLOT_COUNT || (senseClear(s, 0) && sensePinsFree(s + 1));
+}
+
+static_assert(sensePinsFree(0), "SENSE_PINS must not share pins with DISPLAY_PINS");
+
 void setup() {
   Serial.begin(115200);
   
   // Initialize all displays
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    displays[i] = new TM1637Display(DISPLAY_PINS[i].clk, DISPLAY_PINS[i].dio);
     displays[i]->setBrightness(brightness);
-    displays[i]->clear();
-    
-    // Show slot number during startup
-    displays[i]->showNumberDec(i+1);
+    tmAttach(i);
   }
   
-  delay(1000);
+  initAlerts();
+  initSensing();
   
-  // Clear all displays
-  for (int i = 0; i < 4; i++) {
-    displays[i]->clear();
+  // Bring back whatever was counting down before the reset and show it
+  // straight away
+  bool restored = restoreCheckpoint();
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    clearFrame(i);
+    updateDisplay(i);
   }
+  flushAllDisplays();
   
-  Serial.println("4SLOT_TIMER_READY");
-  Serial.println("Commands: SLOTn:value, BRIGHT:x, TEST, RESET, STATUS, PAUSE:n, RESUME:n, SYNC:n:seconds, HELP");
+  Serial.println(F("4SLOT_TIMER_READY"));
+  reportRestored(restored);
 }
 
 void loop() {
+  unsigned long loopStart = micros();
+  
   // Read serial commands
   if (Serial.available()) {
     String command = Serial.readStringUntil('\n');
@@ -77,17 +388,38 @@ void loop() {
   }
   
   // Update all displays
-  for (int slot = 0; slot < 4; slot++) {
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
     updateDisplay(slot);
   }
   
-  // Send heartbeat every 5 seconds
-  if (millis() - lastHeartbeat > 5000) {
-    Serial.println("READY");
-    lastHeartbeat = millis();
+  unsigned long flushStart = micros();
+  flushDisplays();
+  profFlushUs += micros() - flushStart;
+  
+  updateSessions();
+  checkVcc();
+  publishCurrent();
+  sendNextEvent();
+  handleCheckpoint();
+  
+  // Status frame on change, otherwise as the heartbeat
+  if (stateVersion != sentVersion || millis() - lastHeartbeat >= HEARTBEAT_MS) {
+    sendStatusFrame();
   }
   
-  delay(50);  // Reduced delay for more responsive blinking
+  updateProfiler(micros() - loopStart);
+  
+  // No delay: the display flush only writes changes, and plug decisions
+  // are made as soon as each sense window closes
+}
+
+// Command names are compared straight from flash so they take no SRAM
+bool equalsP(const String& s, PGM_P text) {
+  return strcmp_P(s.c_str(), text) == 0;
+}
+
+bool startsWithP(const String& s, PGM_P prefix) {
+  return strncmp_P(s.c_str(), prefix, strlen_P(prefix)) == 0;
 }
 
 void processCommand(String cmd) {
@@ -104,16 +436,34 @@ void processCommand(String cmd) {
   // "PAUSE:1"     - Pause slot 1
   // "RESUME:1"    - Resume slot 1
   // "SYNC:1:3600" - Sync slot 1 to exact time
+  // "TIME:123456" - Share the Pi's clock (ms) as time base
+  // "DEADLINE:1:t"- Run slot 1 until Pi time t (ms)
+  // "PAUSE:1:t"   - Pause slot 1 as of Pi time t
+  // "RESUME:1:t"  - Resume slot 1 as of Pi time t
   // "STATUS"      - Get all slot times
+  // "STATUS_BIN"  - Send the binary status frame now
+  // "PROFILE"     - Loop and display write rates
+  // "DRIFT"       - Timekeeping drift statistics
+  // "BENCH"       - Time a full refresh: library vs direct-port driver
+  // "SESSION:1:3600" - Arm slot 1; runs while a device draws current
+  // "PLUGCFG:800,500,60" - Plug/unplug mA and idle timeout (s)
+  // "CURRENT"     - Per-slot current and session state
+  // "CURRENTRATE:500" - Publish CURRENT every 500 ms (0 = off)
+  // "ZERO"        - Auto-zero all current sensors (ZERO:n for one slot)
+  // "ALERTS:1:300,60/5" - Slot 1 alerts at 300 s, 60 s and the last 5 s
+  // "ALERTS"      - Show alert schedules and event queue
+  // "EVTACK:ON"   - Resend EVT frames until ACK:seq
   // "RESET"       - Reset all slots
   // "HELP"        - Show help
   
-  if (cmd.startsWith("SLOT")) {
-    int slotNum = cmd.charAt(4) - '1';  // 0-based index
+  if (startsWithP(cmd, PSTR("SLOT"))) {
+    int slotNum = cmd.substring(4).toInt() - 1;  // 0-based index
     
-    if (slotNum < 0 || slotNum > 3) {
-      Serial.print("ERROR: Invalid slot number. Use 1-4. Got: ");
-      Serial.println(cmd.charAt(4));
+    if (slotNum < 0 || slotNum >= SLOT_COUNT) {
+      Serial.print(F("ERROR: Invalid slot number. Use 1-"));
+      Serial.print(SLOT_COUNT);
+      Serial.print(F(". Got: "));
+      Serial.println(slotNum + 1);
       return;
     }
     
@@ -122,103 +472,153 @@ void processCommand(String cmd) {
       String valueStr = cmd.substring(colonPos + 1);
       valueStr.toUpperCase();  // Case-insensitive for OFF/WAIT
       
-      if (valueStr == "OFF" || valueStr == "0") {
+      if (equalsP(valueStr, PSTR("OFF")) || equalsP(valueStr, PSTR("0"))) {
         slotTimes[slotNum] = 0;
         slotActive[slotNum] = false;
         slotPaused[slotNum] = false;
-        displays[slotNum]->clear();
-        Serial.print("SLOT");
+        slotFlash[slotNum] = 0;
+        clearFrame(slotNum);
+        slotsChanged();
+        Serial.print(F("SLOT"));
         Serial.print(slotNum + 1);
-        Serial.println(":OFF");
+        Serial.println(F(":OFF"));
       }
-      else if (valueStr == "-" || valueStr == "WAIT") {
+      else if (equalsP(valueStr, PSTR("-")) || equalsP(valueStr, PSTR("WAIT"))) {
         // Show "--" for waiting/available slot
         slotActive[slotNum] = false;
         slotPaused[slotNum] = false;
-        displays[slotNum]->clear();
+        slotFlash[slotNum] = 0;
         // Show "-- --" pattern
-        displays[slotNum]->setSegments(SEG_DASH2, 2, 0);
-        displays[slotNum]->setSegments(SEG_DASH2, 2, 2);
-        Serial.print("SLOT");
+        dashFrame(slotNum);
+        slotsChanged();
+        Serial.print(F("SLOT"));
         Serial.print(slotNum + 1);
-        Serial.println(":WAITING");
+        Serial.println(F(":WAITING"));
       }
       else {
         // Set time in seconds
         int newTime = valueStr.toInt();
         if (newTime < 0) {
-          Serial.print("ERROR: Time cannot be negative: ");
+          Serial.print(F("ERROR: Time cannot be negative: "));
           Serial.println(newTime);
           return;
         }
         
-        slotTimes[slotNum] = newTime;
+        startSlot(slotNum, newTime);
+        sessState[slotNum] = SESS_NONE;  // Plain countdown
         slotActive[slotNum] = (slotTimes[slotNum] > 0);
         slotPaused[slotNum] = false;
+        slotsChanged();
         
         if (slotActive[slotNum]) {
-          lastDecrement[slotNum] = millis();
-          lastBlink[slotNum] = millis();
-          Serial.print("SLOT");
+          Serial.print(F("SLOT"));
           Serial.print(slotNum + 1);
-          Serial.print(":SET:");
+          Serial.print(F(":SET:"));
           Serial.println(slotTimes[slotNum]);
         } else {
-          displays[slotNum]->clear();
-          Serial.print("SLOT");
+          clearFrame(slotNum);
+          Serial.print(F("SLOT"));
           Serial.print(slotNum + 1);
-          Serial.println(":CLEARED");
+          Serial.println(F(":CLEARED"));
         }
       }
     }
   }
-  else if (cmd.startsWith("BRIGHT:")) {
+  else if (startsWithP(cmd, PSTR("BRIGHT:"))) {
     int newBrightness = cmd.substring(7).toInt();
     brightness = constrain(newBrightness, 0, 7);
     
-    for (int i = 0; i < 4; i++) {
+    tmDisplayCtrl = 0x88 | brightness;
+    for (int i = 0; i < SLOT_COUNT; i++) {
       displays[i]->setBrightness(brightness);
+      shownValid[i] = false;  // Brightness is latched on the next write
     }
-    Serial.print("BRIGHTNESS:");
+    Serial.print(F("BRIGHTNESS:"));
     Serial.println(brightness);
   }
-  else if (cmd.startsWith("PAUSE:")) {
+  else if (startsWithP(cmd, PSTR("TIME:"))) {
+    unsigned long piNow = strtoul(cmd.substring(5).c_str(), NULL, 10);
+    setTimeBase(piNow);
+  }
+  else if (startsWithP(cmd, PSTR("DEADLINE:"))) {
+    // Format: DEADLINE:slot:pi_ms
+    int colon2 = cmd.indexOf(':', 9);
+    int slotNum = cmd.substring(9).toInt() - 1;
+    unsigned long at;
+    
+    if (colon2 == -1) {
+      Serial.println(F("ERROR: Invalid DEADLINE format. Use: DEADLINE:slot:pi_ms"));
+    } else if (slotNum < 0 || slotNum >= SLOT_COUNT) {
+      Serial.print(F("ERROR: Invalid slot for DEADLINE: "));
+      Serial.println(slotNum + 1);
+    } else if (parseStamp(cmd, colon2 + 1, at)) {
+      long left = (long)(at - millis());
+      if (left <= 0) {
+        Serial.print(F("ERROR: Deadline already passed for slot "));
+        Serial.println(slotNum + 1);
+      } else if (left > SLOT_SECONDS_MAX * 1000L) {
+        Serial.print(F("ERROR: Deadline too far ahead for slot "));
+        Serial.println(slotNum + 1);
+      } else {
+        startSlot(slotNum, 0);
+        sessState[slotNum] = SESS_NONE;
+        slotRemainingMs[slotNum] = left;
+        slotAnchorMs[slotNum] = left;
+        slotDeadline[slotNum] = at;
+        slotTimes[slotNum] = (left + 999) / 1000;
+        slotActive[slotNum] = true;
+        slotPaused[slotNum] = false;
+        slotsChanged();
+        Serial.print(F("SLOT"));
+        Serial.print(slotNum + 1);
+        Serial.print(F(":SET:"));
+        Serial.println(slotTimes[slotNum]);
+      }
+    }
+  }
+  else if (startsWithP(cmd, PSTR("PAUSE:"))) {
     int slotNum = cmd.substring(6).toInt() - 1;
-    if (slotNum >= 0 && slotNum < 4) {
+    int colon2 = cmd.indexOf(':', 6);
+    unsigned long at = millis();
+    if (colon2 != -1 && !parseStamp(cmd, colon2 + 1, at)) return;
+    
+    if (slotNum >= 0 && slotNum < SLOT_COUNT) {
       if (slotActive[slotNum] && slotTimes[slotNum] > 0) {
-        slotPaused[slotNum] = true;
-        Serial.print("SLOT");
+        pauseSlotAt(slotNum, at);
+        Serial.print(F("SLOT"));
         Serial.print(slotNum + 1);
-        Serial.println(":PAUSED");
+        Serial.println(F(":PAUSED"));
       } else {
-        Serial.print("ERROR: Cannot pause inactive slot ");
+        Serial.print(F("ERROR: Cannot pause inactive slot "));
         Serial.println(slotNum + 1);
       }
     } else {
-      Serial.print("ERROR: Invalid slot for PAUSE: ");
+      Serial.print(F("ERROR: Invalid slot for PAUSE: "));
       Serial.println(slotNum + 1);
     }
   }
-  else if (cmd.startsWith("RESUME:")) {
+  else if (startsWithP(cmd, PSTR("RESUME:"))) {
     int slotNum = cmd.substring(7).toInt() - 1;
-    if (slotNum >= 0 && slotNum < 4) {
+    int colon2 = cmd.indexOf(':', 7);
+    unsigned long at = millis();
+    if (colon2 != -1 && !parseStamp(cmd, colon2 + 1, at)) return;
+    
+    if (slotNum >= 0 && slotNum < SLOT_COUNT) {
       if (slotTimes[slotNum] > 0) {
-        slotPaused[slotNum] = false;
-        slotActive[slotNum] = true;
-        lastDecrement[slotNum] = millis();
-        Serial.print("SLOT");
+        resumeSlotAt(slotNum, at);
+        Serial.print(F("SLOT"));
         Serial.print(slotNum + 1);
-        Serial.println(":RESUMED");
+        Serial.println(F(":RESUMED"));
       } else {
-        Serial.print("ERROR: Cannot resume empty slot ");
+        Serial.print(F("ERROR: Cannot resume empty slot "));
         Serial.println(slotNum + 1);
       }
     } else {
-      Serial.print("ERROR: Invalid slot for RESUME: ");
+      Serial.print(F("ERROR: Invalid slot for RESUME: "));
       Serial.println(slotNum + 1);
     }
   }
-  else if (cmd.startsWith("SYNC:")) {
+  else if (startsWithP(cmd, PSTR("SYNC:"))) {
     // Format: SYNC:slot:seconds
     int colon1 = cmd.indexOf(':');
     int colon2 = cmd.indexOf(':', colon1 + 1);
@@ -226,66 +626,124 @@ void processCommand(String cmd) {
       int slotNum = cmd.substring(colon1 + 1, colon2).toInt() - 1;
       int newTime = cmd.substring(colon2 + 1).toInt();
       
-      if (slotNum >= 0 && slotNum < 4) {
+      if (slotNum >= 0 && slotNum < SLOT_COUNT) {
         if (newTime >= 0) {
-          slotTimes[slotNum] = newTime;
-          lastDecrement[slotNum] = millis();
+          if (slotActive[slotNum]) {
+            recordDrift(slotNum, newTime);
+          }
+          startSlot(slotNum, newTime);
           if (newTime > 0) {
+            // A session slot stays paused until a device draws current
             slotActive[slotNum] = true;
-            slotPaused[slotNum] = false;
+            slotPaused[slotNum] = sessState[slotNum] != SESS_NONE &&
+                                  sessState[slotNum] != SESS_CHARGING;
           }
-          Serial.print("SLOT");
+          slotsChanged();
+          Serial.print(F("SLOT"));
           Serial.print(slotNum + 1);
-          Serial.print(":SYNCED:");
+          Serial.print(F(":SYNCED:"));
           Serial.println(slotTimes[slotNum]);
         } else {
-          Serial.print("ERROR: Invalid time value: ");
+          Serial.print(F("ERROR: Invalid time value: "));
           Serial.println(newTime);
         }
       } else {
-        Serial.print("ERROR: Invalid slot for SYNC: ");
+        Serial.print(F("ERROR: Invalid slot for SYNC: "));
         Serial.println(slotNum + 1);
       }
     } else {
-      Serial.println("ERROR: Invalid SYNC format. Use: SYNC:slot:seconds");
+      Serial.println(F("ERROR: Invalid SYNC format. Use: SYNC:slot:seconds"));
     }
   }
-  else if (cmd == "TEST") {
-    testDisplays();
-    Serial.println("TEST:COMPLETE");
+  else if (equalsP(cmd, PSTR("TEST"))) {
+    testDisplays();  // Prints TEST:COMPLETE
   }
-  else if (cmd == "RESET") {
-    for (int i = 0; i < 4; i++) {
+  else if (equalsP(cmd, PSTR("RESET"))) {
+    for (int i = 0; i < SLOT_COUNT; i++) {
       slotTimes[i] = 0;
       slotActive[i] = false;
       slotPaused[i] = false;
-      displays[i]->clear();
+      slotFlash[i] = 0;
+      clearFrame(i);
     }
-    Serial.println("ALL_SLOTS_RESET");
+    slotsChanged();
+    Serial.println(F("ALL_SLOTS_RESET"));
   }
-  else if (cmd == "STATUS") {
-    Serial.print("STATUS:");
-    for (int i = 0; i < 4; i++) {
+  else if (equalsP(cmd, PSTR("STATUS"))) {
+    Serial.print(F("STATUS:"));
+    for (int i = 0; i < SLOT_COUNT; i++) {
       Serial.print(slotTimes[i]);
-      Serial.print(":");
-      Serial.print(slotActive[i] ? "A" : "I");
-      Serial.print(slotPaused[i] ? "P" : "R");
-      if (i < 3) Serial.print(",");
+      Serial.print(':');
+      Serial.print(slotActive[i] ? 'A' : 'I');
+      Serial.print(slotPaused[i] ? 'P' : 'R');
+      if (i < SLOT_COUNT - 1) Serial.print(',');
     }
     Serial.println();
   }
-  else if (cmd == "HELP") {
+  else if (startsWithP(cmd, PSTR("SESSION:"))) {
+    startSession(cmd);
+  }
+  else if (startsWithP(cmd, PSTR("PLUGCFG:"))) {
+    setPlugConfig(cmd);
+  }
+  else if (equalsP(cmd, PSTR("PLUGCFG"))) {
+    showPlugConfig();
+  }
+  else if (equalsP(cmd, PSTR("CURRENT"))) {
+    showCurrent();
+  }
+  else if (startsWithP(cmd, PSTR("CURRENTRATE:"))) {
+    long rate = cmd.substring(12).toInt();
+    currentRateMs = (rate <= 0) ? 0 : constrain(rate, 50L, 60000L);
+    Serial.print(F("CURRENTRATE:"));
+    Serial.println(currentRateMs);
+  }
+  else if (equalsP(cmd, PSTR("ZERO")) || startsWithP(cmd, PSTR("ZERO:"))) {
+    startZero(cmd.length() > 5 ? cmd.substring(5).toInt() : 0);
+  }
+  else if (startsWithP(cmd, PSTR("ALERTS:"))) {
+    setAlerts(cmd);
+  }
+  else if (equalsP(cmd, PSTR("ALERTS"))) {
+    showAlerts();
+  }
+  else if (startsWithP(cmd, PSTR("ACK:"))) {
+    ackEvent(cmd.substring(4).toInt());
+  }
+  else if (startsWithP(cmd, PSTR("EVTACK:"))) {
+    evtAckMode = equalsP(cmd.substring(7), PSTR("ON"));
+    Serial.print(F("EVTACK:"));
+    Serial.println(evtAckMode ? F("ON") : F("OFF"));
+  }
+  else if (equalsP(cmd, PSTR("BENCH"))) {
+    runBench();
+  }
+  else if (equalsP(cmd, PSTR("DRIFT"))) {
+    showDrift();
+  }
+  else if (equalsP(cmd, PSTR("PROFILE"))) {
+    showProfile();
+  }
+  else if (equalsP(cmd, PSTR("STATUS_BIN"))) {
+    lastHeartbeat = millis() - HEARTBEAT_MS;  // Next loop pass sends one
+  }
+  else if (equalsP(cmd, PSTR("HELP"))) {
     showHelp();
   }
   else {
-    Serial.print("ERROR: Unknown command '");
+    Serial.print(F("ERROR: Unknown command '"));
     Serial.print(cmd);
-    Serial.println("'");
-    Serial.println("Type HELP for available commands");
+    Serial.println('\'');
+    Serial.println(F("Type HELP for available commands"));
   }
 }
 
 void updateDisplay(int slot) {
+  if (slotFlash[slot] > 0) {
+    updateFlash(slot);
+    return;
+  }
+  
   if (!slotActive[slot] || slotPaused[slot]) {
     if (slotPaused[slot] && slotTimes[slot] > 0) {
       // Show paused indication (blink colon solid)
@@ -295,141 +753,1188 @@ void updateDisplay(int slot) {
     return;
   }
   
-  // Decrement time every second
-  if (millis() - lastDecrement[slot] >= 1000) {
-    if (slotTimes[slot] > 0) {
-      slotTimes[slot]--;
-      lastDecrement[slot] = millis();
-      
-      // Send alerts for low time
-      if (slotTimes[slot] == 300) {
-        Serial.print("ALERT:SLOT");
-        Serial.print(slot + 1);
-        Serial.println(":5MIN");
-      } else if (slotTimes[slot] == 60) {
-        Serial.print("ALERT:SLOT");
-        Serial.print(slot + 1);
-        Serial.println(":1MIN");
-      } else if (slotTimes[slot] == 30) {
-        Serial.print("ALERT:SLOT");
-        Serial.print(slot + 1);
-        Serial.println(":30SEC");
-      } else if (slotTimes[slot] == 10) {
-        Serial.print("ALERT:SLOT");
-        Serial.print(slot + 1);
-        Serial.println(":10SEC");
-      } else if (slotTimes[slot] <= 5 && slotTimes[slot] > 0) {
-        Serial.print("ALERT:SLOT");
-        Serial.print(slot + 1);
-        Serial.print(":");
-        Serial.print(slotTimes[slot]);
-        Serial.println("SEC");
-      }
-      
-      if (slotTimes[slot] == 0) {
-        slotActive[slot] = false;
-        slotPaused[slot] = false;
-        Serial.print("COMPLETE:SLOT");
-        Serial.println(slot + 1);
-        
-        // Flash display 3 times when complete
-        for (int i = 0; i < 3; i++) {
-          displays[slot]->setSegments(SEG_DASH2, 2, 0);
-          displays[slot]->setSegments(SEG_DASH2, 2, 2);
-          delay(300);
-          displays[slot]->clear();
-          delay(300);
-        }
-        return;
-      }
-    }
+  unsigned long msLeft = remainingMs(slot);
+  int timeLeft = (msLeft + 999) / 1000;
+  
+  if (timeLeft != slotTimes[slot]) {
+    // How long after the seconds boundary we got round to showing it
+    unsigned long late = (unsigned long)timeLeft * 1000 - msLeft;
+    if (late > driftLateMaxMs) driftLateMaxMs = late;
+    
+    sendAlerts(slot, slotTimes[slot], timeLeft);
+    slotTimes[slot] = timeLeft;
   }
   
-  // Blink colon every second
-  if (millis() - lastBlink[slot] >= 500) {
-    blinkColon[slot] = !blinkColon[slot];
+  if (timeLeft == 0) {
+    slotActive[slot] = false;
+    slotPaused[slot] = false;
+    slotsChanged();
+    queueEvent(EVT_COMPLETE, 0, slot);
+    
+    // Flash display 3 times when complete, without blocking the loop
+    slotFlash[slot] = FLASH_PHASES;
     lastBlink[slot] = millis();
+    dashFrame(slot);
+    return;
   }
   
+  // Colon is on for the first half of each second, in step with the digits
+  blinkColon[slot] = (msLeft % 1000) >= 500;
+  
   // Format display based on time remaining
-  int timeLeft = slotTimes[slot];
+  renderTime(slot, timeLeft, blinkColon[slot]);
   
-  if (timeLeft >= 3600) {
-    // Display hours and minutes (H:MM)
-    int hours = timeLeft / 3600;
-    int minutes = (timeLeft % 3600) / 60;
-    int displayValue = hours * 100 + minutes;
+  // Blink entire display when less than 10 seconds
+  if (timeLeft <= 10 && blinkColon[slot]) {
+    clearFrame(slot);
+  }
+}
+
+void sendAlerts(int slot, int prevTime, int timeLeft) {
+  // Thresholds are checked as crossings so a slow pass cannot skip one
+  for (int i = 0; i < ALERT_MAX; i++) {
+    int at = alertAt[slot][i];
+    if (at > 0 && prevTime > at && timeLeft <= at) {
+      queueEvent(EVT_ALERT, at, slot);
+    }
+  }
+  if (timeLeft <= alertFinal[slot] && timeLeft > 0) {
+    queueEvent(EVT_ALERT, timeLeft, slot);
+  }
+}
+
+void initAlerts() {
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    for (int i = 0; i < ALERT_MAX; i++) {
+      alertAt[slot][i] = pgm_read_word(&ALERT_DEFAULTS[i]);
+    }
+    alertFinal[slot] = ALERT_FINAL_DEFAULT;
+  }
+}
+
+void queueEvent(uint8_t kind, uint16_t value, int slot) {
+  // Coalesce into a matching event that is still waiting to go out
+  for (uint8_t i = 0; i < evtCount; i++) {
+    SlotEvent& e = evtQueue[i];
+    if (!e.sent && e.kind == kind && e.value == value) {
+      e.slots |= 1 << slot;
+      return;
+    }
+  }
+  
+  if (evtCount == EVT_QUEUE_SIZE) {
+    removeEvent(0);  // Drop the oldest rather than block
+    evtDropped++;
+  }
+  SlotEvent& e = evtQueue[evtCount++];
+  e.seq = ++evtSeq;
+  e.kind = kind;
+  e.value = value;
+  e.slots = 1 << slot;
+  e.sent = false;
+  e.sentAt = 0;
+}
+
+void removeEvent(uint8_t index) {
+  for (uint8_t i = index; i + 1 < evtCount; i++) {
+    evtQueue[i] = evtQueue[i + 1];
+  }
+  evtCount--;
+}
+
+// Send at most one frame per loop pass, and only if it fits in the TX
+// buffer without waiting
+void sendNextEvent() {
+  if (Serial.availableForWrite() < EVT_FRAME_MAX) return;
+  
+  for (uint8_t i = 0; i < evtCount; i++) {
+    SlotEvent& e = evtQueue[i];
+    if (e.sent && millis() - e.sentAt < EVT_RETRY_MS) continue;
+    
+    Serial.print(F("EVT:"));
+    Serial.print(e.seq);
+    Serial.print(',');
+    Serial.print(eventName(e.kind));
+    Serial.print(',');
+    Serial.print(e.value);
+    Serial.print(',');
+    bool first = true;
+    for (int slot = 0; slot < SLOT_COUNT; slot++) {
+      if (!(e.slots & (1 << slot))) continue;
+      if (!first) Serial.print('+');
+      Serial.print(slot + 1);
+      first = false;
+    }
+    Serial.println();
     
-    displays[slot]->showNumberDecEx(displayValue, 
-      blinkColon[slot] ? 0x40 : 0x00,  // Colon on/off
-      true, 3, 0);  // Show 3 digits starting at position 0
+    if (evtAckMode) {
+      e.sent = true;
+      e.sentAt = millis();
+    } else {
+      removeEvent(i);
+    }
+    return;
   }
-  else if (timeLeft >= 60) {
-    // Display minutes and seconds (MM:SS)
-    int minutes = timeLeft / 60;
-    int seconds = timeLeft % 60;
-    int displayValue = minutes * 100 + seconds;
+}
+
+const __FlashStringHelper* eventName(uint8_t kind) {
+  switch (kind) {
+    case EVT_COMPLETE:  return F("COMPLETE");
+    case EVT_PLUGGED:   return F("PLUGGED");
+    case EVT_UNPLUGGED: return F("UNPLUGGED");
+    case EVT_IDLE_END:  return F("IDLE_END");
+    default:            return F("ALERT");
+  }
+}
+
+void ackEvent(uint16_t seq) {
+  for (uint8_t i = 0; i < evtCount; i++) {
+    if (evtQueue[i].seq == seq) {
+      removeEvent(i);
+      return;
+    }
+  }
+}
+
+// Format: ALERTS:slot:t1,t2,.../final  (slot 0 = all slots)
+void setAlerts(String cmd) {
+  int colon2 = cmd.indexOf(':', 7);
+  int slotNum = cmd.substring(7).toInt();
+  if (colon2 == -1 || slotNum < 0 || slotNum > SLOT_COUNT) {
+    Serial.println(F("ERROR: Invalid ALERTS format. Use: ALERTS:slot:t1,t2,.../final"));
+    return;
+  }
+  
+  uint16_t at[ALERT_MAX] = {0};
+  int count = 0;
+  int finalAt = ALERT_FINAL_DEFAULT;
+  String list = cmd.substring(colon2 + 1);
+  int slash = list.indexOf('/');
+  if (slash != -1) {
+    finalAt = list.substring(slash + 1).toInt();
+    list = list.substring(0, slash);
+  }
+  
+  int pos = 0;
+  while (pos < list.length()) {
+    int comma = list.indexOf(',', pos);
+    if (comma == -1) comma = list.length();
+    long value = list.substring(pos, comma).toInt();
+    if (count >= ALERT_MAX || value <= 0 || value > 32767) {
+      Serial.println(F("ALERTS_ERROR:THRESHOLDS"));
+      return;
+    }
+    at[count++] = value;
+    pos = comma + 1;
+  }
+  if (finalAt < 0 || finalAt > 60) {
+    Serial.println(F("ALERTS_ERROR:FINAL"));
+    return;
+  }
+  
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    if (slotNum != 0 && slot != slotNum - 1) continue;
+    for (int i = 0; i < ALERT_MAX; i++) alertAt[slot][i] = at[i];
+    alertFinal[slot] = finalAt;
+  }
+  Serial.println(F("ALERTS_OK"));
+}
+
+void showAlerts() {
+  // ALERTS:SLOTn:t1,t2,.../final per slot, then the queue state
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    Serial.print(F("ALERTS:SLOT"));
+    Serial.print(slot + 1);
+    Serial.print(':');
+    bool first = true;
+    for (int i = 0; i < ALERT_MAX; i++) {
+      if (alertAt[slot][i] == 0) continue;
+      if (!first) Serial.print(',');
+      Serial.print(alertAt[slot][i]);
+      first = false;
+    }
+    Serial.print('/');
+    Serial.println(alertFinal[slot]);
+  }
+  Serial.print(F("EVTQ:"));
+  Serial.print(evtCount);
+  Serial.print(',');
+  Serial.print(evtDropped);
+  Serial.print(',');
+  Serial.println(evtAckMode ? F("ACK") : F("NOACK"));
+}
+
+void updateFlash(int slot) {
+  if (millis() - lastBlink[slot] < FLASH_PHASE_MS) return;
+  lastBlink[slot] = millis();
+  slotFlash[slot]--;
+  
+  // Even phases show dashes, odd phases and the end are blank
+  if (slotFlash[slot] > 0 && slotFlash[slot] % 2 == 0) {
+    dashFrame(slot);
+  } else {
+    clearFrame(slot);
+  }
+}
+
+unsigned long remainingMs(int slot) {
+  if (slotPaused[slot] || !slotActive[slot]) {
+    return slotRemainingMs[slot];
+  }
+  long left = (long)(slotDeadline[slot] - millis());
+  return left > 0 ? left : 0;
+}
+
+// Pause as of local time 'at', which may be slightly in the past
+void pauseSlotAt(int slot, unsigned long at) {
+  if (!slotPaused[slot]) {
+    long left = (long)(slotDeadline[slot] - at);
+    slotRemainingMs[slot] = left > 0 ? left : 0;
+    slotTimes[slot] = (slotRemainingMs[slot] + 999) / 1000;
+  }
+  slotPaused[slot] = true;
+  slotsChanged();
+}
+
+void resumeSlotAt(int slot, unsigned long at) {
+  if (slotPaused[slot] || !slotActive[slot]) {
+    slotDeadline[slot] = at + slotRemainingMs[slot];
+  }
+  slotPaused[slot] = false;
+  slotActive[slot] = true;
+  slotsChanged();
+}
+
+void endSlot(int slot) {
+  slotTimes[slot] = 0;
+  slotActive[slot] = false;
+  slotPaused[slot] = false;
+  slotFlash[slot] = 0;
+  clearFrame(slot);
+  slotsChanged();
+}
+
+// Start (or restart) a slot's countdown from a whole number of seconds
+void startSlot(int slot, int seconds) {
+  unsigned long ms = (unsigned long)seconds * 1000;
+  slotTimes[slot] = seconds;
+  slotRemainingMs[slot] = ms;
+  slotAnchorMs[slot] = ms;
+  slotDeadline[slot] = millis() + ms;
+  slotFlash[slot] = 0;
+}
+
+void recordDrift(int slot, int piSeconds) {
+  // Positive error means our countdown runs fast relative to the Pi
+  unsigned long ours = remainingMs(slot);
+  long errMs = (long)piSeconds * 1000 - (long)ours;
+  unsigned long elapsed = slotAnchorMs[slot] - ours;
+  noteDrift(errMs, elapsed);
+}
+
+void noteDrift(long errMs, unsigned long elapsed) {
+  driftSyncs++;
+  driftLastMs = errMs;
+  driftSumMs += errMs;
+  if (labs(errMs) > driftMaxMs) driftMaxMs = labs(errMs);
+  
+  // The Pi sends whole seconds, so only trust the rate over longer runs
+  if (elapsed >= 60000UL) {
+    driftPpm = (long)((float)errMs * 1000000.0 / (float)elapsed);
+  }
+}
+
+// Binary frame: "STATUS_BIN:<n>" line, then n bytes, then newline.
+// Payload (little-endian): version u16, slot count u8, active mask u16,
+// paused mask u16, loops/s u16, worst loop us u16, remaining seconds u16
+// per slot, XOR checksum. Skipped until the TX buffer can take it whole.
+void sendStatusFrame() {
+  uint8_t payload[11 + 2 * SLOT_COUNT];
+  uint8_t n = 0;
+  uint16_t activeMask = 0;
+  uint16_t pausedMask = 0;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (slotActive[i]) activeMask |= 1 << i;
+    if (slotPaused[i]) pausedMask |= 1 << i;
+  }
+  
+  payload[n++] = stateVersion & 0xFF;
+  payload[n++] = stateVersion >> 8;
+  payload[n++] = SLOT_COUNT;
+  payload[n++] = activeMask & 0xFF;
+  payload[n++] = activeMask >> 8;
+  payload[n++] = pausedMask & 0xFF;
+  payload[n++] = pausedMask >> 8;
+  uint16_t loops = min(profLastLoops, 65535UL);
+  uint16_t loopMax = min(profLastLoopMaxUs, 65535UL);
+  payload[n++] = loops & 0xFF;
+  payload[n++] = loops >> 8;
+  payload[n++] = loopMax & 0xFF;
+  payload[n++] = loopMax >> 8;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    uint16_t left = slotActive[i] ? slotTimes[i] : 0;
+    payload[n++] = left & 0xFF;
+    payload[n++] = left >> 8;
+  }
+  
+  // Header line + payload + checksum + newline
+  if (Serial.availableForWrite() < 16 + n + 3) return;
+  
+  Serial.print(F("STATUS_BIN:"));
+  Serial.println(n + 1);
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < n; i++) sum ^= payload[i];
+  Serial.write(payload, n);
+  Serial.write(sum);
+  Serial.println();
+  
+  sentVersion = stateVersion;
+  lastHeartbeat = millis();
+}
+
+// Called whenever a slot starts, stops, pauses or resumes
+void slotsChanged() {
+  ckptDue = true;
+  stateVersion++;
+}
+
+uint16_t crc16Update(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+uint16_t checkpointCrc(const CheckpointRecord& r) {
+  uint16_t crc = 0xFFFF;
+  const uint8_t* p = (const uint8_t*)&r;
+  for (uint8_t i = 0; i < offsetof(CheckpointRecord, crc); i++) {
+    crc = crc16Update(crc, p[i]);
+  }
+  return crc;
+}
+
+int checkpointAddr(uint8_t index) {
+  return CKPT_EEPROM_ADDR + index * sizeof(CheckpointRecord);
+}
+
+void handleCheckpoint() {
+  unsigned long since = millis() - lastCheckpoint;
+  bool running = false;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (slotActive[i] && !slotPaused[i]) running = true;
+  }
+  
+  if (ckptDue && since >= CKPT_MIN_GAP_MS) {
+    saveCheckpoint(CKPT_CHANGE);
+  } else if (running && since >= CKPT_INTERVAL_MS) {
+    saveCheckpoint(CKPT_PERIODIC);
+  }
+}
+
+void saveCheckpoint(uint8_t reason) {
+  CheckpointRecord r;
+  r.magic = CKPT_MAGIC;
+  r.reason = reason;
+  r.seq = ++ckptSeq;
+  r.activeMask = 0;
+  r.pausedMask = 0;
+  r.sessionMask = 0;
+  r.piStamp = timeBaseSet ? millis() + piOffset : 0;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    bool active = slotActive[i] && slotTimes[i] > 0;
+    r.remainingMs[i] = active ? remainingMs(i) : 0;
+    if (active) r.activeMask |= 1 << i;
+    if (active && slotPaused[i]) r.pausedMask |= 1 << i;
+    if (active && sessState[i] != SESS_NONE) r.sessionMask |= 1 << i;
+  }
+  r.crc = checkpointCrc(r);
+  
+  EEPROM.put(checkpointAddr(ckptNext), r);
+  ckptNext = (ckptNext + 1) % CKPT_RECORDS;
+  ckptDue = false;
+  lastCheckpoint = millis();
+}
+
+// Load the newest valid record into the slot state
+bool restoreCheckpoint() {
+  CheckpointRecord r;
+  int newest = -1;
+  uint16_t newestSeq = 0;
+  
+  for (uint8_t i = 0; i < CKPT_RECORDS; i++) {
+    EEPROM.get(checkpointAddr(i), r);
+    if (r.magic != CKPT_MAGIC || r.crc != checkpointCrc(r)) continue;
+    if (newest < 0 || (int16_t)(r.seq - newestSeq) > 0) {
+      newest = i;
+      newestSeq = r.seq;
+    }
+  }
+  if (newest < 0) return false;
+  
+  ckptSeq = newestSeq;
+  ckptNext = (newest + 1) % CKPT_RECORDS;
+  EEPROM.get(checkpointAddr(newest), r);
+  restoredReason = r.reason;
+  restoredPiStamp = r.piStamp;
+  
+  unsigned long now = millis();
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (!(r.activeMask & (1 << i)) || r.remainingMs[i] == 0) continue;
+    unsigned long ms = r.remainingMs[i];
+    slotActive[i] = true;
+    slotPaused[i] = (r.pausedMask & (1 << i)) != 0;
+    slotRemainingMs[i] = ms;
+    slotAnchorMs[i] = ms;
+    slotDeadline[i] = now + ms;
+    slotTimes[i] = (ms + 999) / 1000;
     
-    displays[slot]->showNumberDecEx(displayValue, 
-      blinkColon[slot] ? 0x40 : 0x00,
-      true);  // Show all 4 digits
+    // Sessions come back paused under plug control: nothing has been
+    // sensed yet, so the countdown resumes on a real plug edge, and the
+    // idle timeout starts over rather than ending the session at once
+    if (r.sessionMask & (1 << i)) {
+      slotPaused[i] = true;
+      sessState[i] = SESS_UNPLUGGED;
+      sessSince[i] = now;
+    }
   }
-  else {
-    // Display seconds only (SS)
-    displays[slot]->showNumberDecEx(timeLeft, 
-      0x00,  // No colon
-      true, 2, 2);  // Show 2 digits at rightmost position
+  // Send STATUS_BIN on the next pass rather than at the next heartbeat;
+  // the record is already in EEPROM, so no checkpoint is due
+  stateVersion++;
+  return true;
+}
+
+void reportRestored(bool restored) {
+  // RESTORED:count,pi_ms,reason[,slot:seconds:R|P]...
+  // pi_ms is the Pi time the checkpoint was taken (0 without a time base)
+  // so the Pi can tell how much of the outage the slots did not count.
+  int count = 0;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (slotActive[i]) count++;
+  }
+  
+  Serial.print(F("RESTORED:"));
+  Serial.print(count);
+  Serial.print(',');
+  Serial.print(restored ? restoredPiStamp : 0UL);
+  Serial.print(',');
+  if (!restored) {
+    Serial.print(F("NONE"));
+  } else if (restoredReason == CKPT_BROWNOUT) {
+    Serial.print(F("BROWNOUT"));
+  } else if (restoredReason == CKPT_PERIODIC) {
+    Serial.print(F("PERIODIC"));
+  } else {
+    Serial.print(F("CHANGE"));
+  }
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (!slotActive[i]) continue;
+    Serial.print(',');
+    Serial.print(i + 1);
+    Serial.print(':');
+    Serial.print(slotTimes[i]);
+    Serial.print(slotPaused[i] ? F(":P") : F(":R"));
+  }
+  Serial.println();
+}
+
+void initSensing() {
+  ZeroRecord z;
+  EEPROM.get(ZERO_EEPROM_ADDR, z);
+  bool zeroValid = z.magic == ZERO_MAGIC && z.crc == zeroCrc(z);
+  
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    sensorZero16[i] = zeroValid ? z.zero16[i] : 512 * 16;
+    isrZero[i] = (sensorZero16[i] + 8) >> 4;
+    uint8_t channel = SENSE_PINS[i] - A0;
+    senseMux[i] = _BV(REFS0) | (channel & 0x07);
+    if (channel < 6) DIDR0 |= 1 << channel;  // No digital buffer on sense pins
+  }
+  
+  // Free running, interrupt on every conversion, 16 MHz / 128
+  ADCSRB = 0;
+  ADMUX = senseMux[0];
+  adcPipe[0] = 0;
+  ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  ADCSRA |= _BV(ADSC);
+  
+  // The first conversion latches its channel one ADC clock (8 us) after
+  // start, so the second channel can be queued
+  delayMicroseconds(16);
+  adcPipe[1] = nextAdcChannel();
+  ADMUX = adcMux(adcPipe[1]);
+}
+
+uint8_t nextAdcChannel() {
+  if (vccRequest) {
+    vccRequest = false;
+    vccSelect = VCC_SETTLE;
+  }
+  if (vccSelect > 0) {
+    vccSelect--;
+    return ADC_VCC;
+  }
+  uint8_t slot = adcNextSlot;
+  adcNextSlot = (slot + 1) % SLOT_COUNT;
+  return slot;
+}
+
+uint8_t adcMux(uint8_t channel) {
+  if (channel == ADC_VCC) return _BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1);
+  return senseMux[channel];
+}
+
+ISR(ADC_vect) {
+  uint16_t value = ADC;
+  uint8_t channel = adcPipe[0];
+  
+  adcPipe[0] = adcPipe[1];
+  adcPipe[1] = nextAdcChannel();
+  ADMUX = adcMux(adcPipe[1]);
+  
+  if (channel == ADC_VCC) {
+    // Count the burst; the last one has had time to settle
+    if (++vccRun >= VCC_SETTLE) {
+      vccRaw = value;
+      vccReady = true;
+      vccRun = 0;
+    }
+    return;
+  }
+  
+  if (isrCount[channel] < SENSE_MAX_SAMPLES) {
+    int16_t d = (int16_t)value - isrZero[channel];
+    isrSumD[channel] += d;
+    isrSumSq[channel] += (int32_t)d * d;
+    isrCount[channel]++;
+  }
+}
+
+uint16_t isqrt32(uint32_t x) {
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+  while (bit > x) bit >>= 2;
+  while (bit) {
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+// Close a slot's window: RMS about the fractional zero, in integer math.
+// With D = 16 * d and F the zero's sixteenths below/above isrZero,
+// mean((D - F)^2) = (256 * sumSq - 32 * F * sumD) / n + F^2.
+void closeSenseWindow(int slot) {
+  noInterrupts();
+  int32_t sumD = isrSumD[slot];
+  uint32_t sumSq = isrSumSq[slot];
+  uint16_t n = isrCount[slot];
+  int16_t zero = isrZero[slot];
+  isrSumD[slot] = 0;
+  isrSumSq[slot] = 0;
+  isrCount[slot] = 0;
+  interrupts();
+  if (n == 0) return;
+  
+  int32_t f = (int32_t)sensorZero16[slot] - (int32_t)zero * 16;
+  int64_t acc = (int64_t)256 * sumSq - (int64_t)32 * f * sumD;
+  int64_t meanSq = acc / n + (int64_t)f * f;
+  uint16_t rms16 = isqrt32(meanSq > 0 ? (uint32_t)min(meanSq, (int64_t)0xFFFFFFFFLL) : 0);
+  
+  sensorMa[slot] = (uint32_t)rms16 * SENSE_UA_PER_COUNT / 16000UL;
+  sensorOffset16[slot] = (int16_t)((sumD * 16) / n - f);
+}
+
+void checkVcc() {
+  if (vccReady) {
+    vccReady = false;
+    handleVcc(vccRaw);
+  }
+  if (millis() - lastVccCheck >= VCC_CHECK_MS) {
+    lastVccCheck = millis();
+    vccRequest = true;
+  }
+}
+
+void handleVcc(uint16_t adc) {
+  if (adc > 0) vccMv = 1125300UL / adc;  // 1.1 V * 1023 * 1000
+  
+  if (!brownoutFlushed && vccMv < VCC_LOW_MV) {
+    saveCheckpoint(CKPT_BROWNOUT);
+    brownoutFlushed = true;
+    Serial.print(F("BROWNOUT:"));
+    Serial.println(vccMv);
+  } else if (brownoutFlushed && vccMv > VCC_OK_MV) {
+    brownoutFlushed = false;
+  }
+}
+
+// slot 0 = all slots; slots drawing current are left alone
+void startZero(int slotNum) {
+  if (slotNum < 0 || slotNum > SLOT_COUNT) {
+    Serial.print(F("ERROR: Invalid slot for ZERO: "));
+    Serial.println(slotNum);
+    return;
+  }
+  zeroMask = 0;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (slotNum != 0 && i != slotNum - 1) continue;
+    if (senseHigh[i]) {
+      Serial.print(F("ZERO_SKIP:"));
+      Serial.println(i + 1);
+      continue;
+    }
+    zeroMask |= 1 << i;
+    zeroSum16[i] = 0;
+  }
+  zeroWindowsLeft = zeroMask ? ZERO_WINDOWS : 0;
+  if (!zeroMask) Serial.println(F("ZERO_ERROR:NO_SLOTS"));
+}
+
+// Called once per window while ZERO is running
+void updateZero() {
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (zeroMask & (1 << i)) zeroSum16[i] += sensorOffset16[i];
+  }
+  if (--zeroWindowsLeft > 0) return;
+  
+  ZeroRecord z;
+  z.magic = ZERO_MAGIC;
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    if (zeroMask & (1 << i)) {
+      sensorZero16[i] += zeroSum16[i] / ZERO_WINDOWS;
+      noInterrupts();
+      isrZero[i] = (sensorZero16[i] + 8) >> 4;
+      isrSumD[i] = 0;
+      isrSumSq[i] = 0;
+      isrCount[i] = 0;
+      interrupts();
+    }
+    z.zero16[i] = sensorZero16[i];
+  }
+  z.crc = zeroCrc(z);
+  EEPROM.put(ZERO_EEPROM_ADDR, z);
+  zeroMask = 0;
+  
+  // ZERO_OK:counts,... (ADC counts at 0 A, one decimal)
+  Serial.print(F("ZERO_OK:"));
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    Serial.print(sensorZero16[i] / 16.0, 1);
+    if (i < SLOT_COUNT - 1) Serial.print(',');
+  }
+  Serial.println();
+}
+
+uint16_t zeroCrc(const ZeroRecord& z) {
+  uint16_t crc = 0xFFFF;
+  const uint8_t* p = (const uint8_t*)&z;
+  for (uint8_t i = 0; i < offsetof(ZeroRecord, crc); i++) {
+    crc = crc16Update(crc, p[i]);
+  }
+  return crc;
+}
+
+void publishCurrent() {
+  if (currentRateMs == 0 || millis() - lastCurrentPublish < currentRateMs) return;
+  if (Serial.availableForWrite() < 8 + SLOT_COUNT * 8) return;
+  lastCurrentPublish = millis();
+  showCurrent();
+}
+
+void updateSessions() {
+  if (millis() - lastSenseWindow < SENSE_WINDOW_MS) return;
+  lastSenseWindow = millis();
+  unsigned long now = millis();
+  
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    closeSenseWindow(slot);
     
-    // Left side blank
-    displays[slot]->showNumberDecEx(0, 0x00, true, 2, 0);
+    // Hysteresis, then debounce; edges are timed from when the current
+    // first crossed, so pause/resume land on the real plug moment
+    bool raw = senseHigh[slot] ? sensorMa[slot] > unplugMa : sensorMa[slot] >= plugMa;
+    bool changed = false;
+    unsigned long edge = senseEdge[slot];
+    if (raw == senseHigh[slot]) {
+      senseEdge[slot] = 0;
+    } else if (edge == 0) {
+      senseEdge[slot] = now;
+    } else if (now - edge >= PLUG_DEBOUNCE_MS) {
+      senseHigh[slot] = raw;
+      senseEdge[slot] = 0;
+      changed = true;
+    }
     
-    // Blink entire display when less than 10 seconds
-    if (timeLeft <= 10) {
-      if (blinkColon[slot]) {
-        displays[slot]->clear();
+    runSession(slot, changed, changed ? edge : now);
+  }
+  
+  if (zeroWindowsLeft > 0) updateZero();
+}
+
+void runSession(int slot, bool changed, unsigned long at) {
+  uint8_t state = sessState[slot];
+  if (state == SESS_NONE) return;
+  
+  // Ended elsewhere: OFF, RESET, or the countdown completed
+  if (!slotActive[slot]) {
+    sessState[slot] = SESS_NONE;
+    return;
+  }
+  
+  if (senseHigh[slot] && state != SESS_CHARGING) {
+    resumeSlotAt(slot, at);
+    setSession(slot, SESS_CHARGING, EVT_PLUGGED);
+  } else if (!senseHigh[slot] && state == SESS_CHARGING && changed) {
+    pauseSlotAt(slot, at);
+    setSession(slot, SESS_UNPLUGGED, EVT_UNPLUGGED);
+  } else if (state != SESS_CHARGING && millis() - sessSince[slot] >= idleTimeoutMs) {
+    setSession(slot, SESS_NONE, EVT_IDLE_END);
+    endSlot(slot);
+  }
+}
+
+void setSession(int slot, uint8_t state, uint8_t event) {
+  sessState[slot] = state;
+  sessSince[slot] = millis();
+  queueEvent(event, slotTimes[slot], slot);
+  slotsChanged();
+}
+
+// Format: SESSION:slot:seconds
+void startSession(String cmd) {
+  int colon2 = cmd.indexOf(':', 8);
+  int slotNum = cmd.substring(8).toInt() - 1;
+  long seconds = colon2 == -1 ? 0 : cmd.substring(colon2 + 1).toInt();
+  
+  if (slotNum < 0 || slotNum >= SLOT_COUNT || seconds <= 0 || seconds > 32767) {
+    Serial.println(F("ERROR: Invalid SESSION format. Use: SESSION:slot:seconds"));
+    return;
+  }
+  
+  startSlot(slotNum, seconds);
+  slotActive[slotNum] = true;
+  slotPaused[slotNum] = true;  // Runs once a device is plugged in
+  sessState[slotNum] = SESS_ARMED;
+  sessSince[slotNum] = millis();
+  slotsChanged();
+  Serial.print(F("SLOT"));
+  Serial.print(slotNum + 1);
+  Serial.print(F(":ARMED:"));
+  Serial.println(seconds);
+}
+
+// Format: PLUGCFG:plug_ma,unplug_ma,idle_s
+void setPlugConfig(String cmd) {
+  int comma1 = cmd.indexOf(',', 8);
+  int comma2 = comma1 == -1 ? -1 : cmd.indexOf(',', comma1 + 1);
+  if (comma2 == -1) {
+    Serial.println(F("ERROR: Invalid PLUGCFG format. Use: PLUGCFG:plug_ma,unplug_ma,idle_s"));
+    return;
+  }
+  long plug = cmd.substring(8, comma1).toInt();
+  long unplug = cmd.substring(comma1 + 1, comma2).toInt();
+  long idle = cmd.substring(comma2 + 1).toInt();
+  if (unplug <= 0 || plug <= unplug || plug > 5000 || idle <= 0 || idle > 3600) {
+    Serial.println(F("PLUGCFG_ERROR"));
+    return;
+  }
+  plugMa = plug;
+  unplugMa = unplug;
+  idleTimeoutMs = idle * 1000UL;
+  showPlugConfig();
+}
+
+void showPlugConfig() {
+  Serial.print(F("PLUGCFG:"));
+  Serial.print(plugMa);
+  Serial.print(',');
+  Serial.print(unplugMa);
+  Serial.print(',');
+  Serial.println(idleTimeoutMs / 1000);
+}
+
+void showCurrent() {
+  // CURRENT:ma:state,... with state - (none), A (armed), C, U
+  static const char STATE_CODES[] PROGMEM = "-ACU";
+  Serial.print(F("CURRENT:"));
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    Serial.print(sensorMa[i]);
+    Serial.print(':');
+    Serial.print((char)pgm_read_byte(&STATE_CODES[sessState[i]]));
+    if (i < SLOT_COUNT - 1) Serial.print(',');
+  }
+  Serial.println();
+}
+
+void setTimeBase(unsigned long piNow) {
+  unsigned long now = millis();
+  unsigned long offset = piNow - now;
+  long step = (long)(offset - piOffset);
+  
+  if (!timeBaseSet) {
+    timeBaseSet = true;
+    Serial.print(F("TIME:SET:"));
+    Serial.println(now);
+  } else if (labs(step) > TIME_SLEW_MAX_MS) {
+    Serial.print(F("TIME:REBASED:"));
+    Serial.println(step);
+  } else {
+    // A positive step means our clock fell behind the Pi's since the last
+    // handshake; pull running deadlines in so countdowns follow the Pi.
+    for (int i = 0; i < SLOT_COUNT; i++) {
+      if (slotActive[i] && !slotPaused[i]) {
+        slotDeadline[i] -= step;
       }
     }
+    noteDrift(-step, now - timeBaseAt);
+    Serial.print(F("TIME:SYNCED:"));
+    Serial.println(step);
   }
+  
+  piOffset = offset;
+  timeBaseAt = now;
+}
+
+// Parse a Pi timestamp at cmd[from] into local millis()
+bool parseStamp(String cmd, int from, unsigned long &local) {
+  if (!timeBaseSet) {
+    Serial.println(F("ERROR: No time base. Send TIME:pi_ms first"));
+    return false;
+  }
+  local = strtoul(cmd.substring(from).c_str(), NULL, 10) - piOffset;
+  return true;
+}
+
+void showDrift() {
+  // DRIFT:syncs,last_ms,mean_ms,max_ms,ppm,late_max_ms
+  Serial.print(F("DRIFT:"));
+  Serial.print(driftSyncs);
+  Serial.print(',');
+  Serial.print(driftLastMs);
+  Serial.print(',');
+  Serial.print(driftSyncs > 0 ? driftSumMs / (long)driftSyncs : 0L);
+  Serial.print(',');
+  Serial.print(driftMaxMs);
+  Serial.print(',');
+  Serial.print(driftPpm);
+  Serial.print(',');
+  Serial.println(driftLateMaxMs);
 }
 
 void displayPaused(int slot, int timeLeft) {
   // Show time with solid colon (no blinking) when paused
+  renderTime(slot, timeLeft, true);
+}
+
+uint8_t digitSegments(uint8_t digit) {
+  return pgm_read_byte(&DIGIT_SEGMENTS[digit]);
+}
+
+void renderTime(int slot, int timeLeft, bool colon) {
+  uint8_t* f = frame[slot];
+  
   if (timeLeft >= 3600) {
+    // Hours and minutes (H:MM), hours right-aligned before the colon
     int hours = timeLeft / 3600;
     int minutes = (timeLeft % 3600) / 60;
-    int displayValue = hours * 100 + minutes;
-    displays[slot]->showNumberDecEx(displayValue, 0x40, true, 3, 0);
+    f[0] = (hours >= 10) ? digitSegments((hours / 10) % 10) : 0;
+    f[1] = digitSegments(hours % 10);
+    f[2] = digitSegments(minutes / 10);
+    f[3] = digitSegments(minutes % 10);
   }
   else if (timeLeft >= 60) {
+    // Minutes and seconds (MM:SS)
     int minutes = timeLeft / 60;
     int seconds = timeLeft % 60;
-    int displayValue = minutes * 100 + seconds;
-    displays[slot]->showNumberDecEx(displayValue, 0x40, true);
+    f[0] = digitSegments((minutes / 10) % 10);
+    f[1] = digitSegments(minutes % 10);
+    f[2] = digitSegments(seconds / 10);
+    f[3] = digitSegments(seconds % 10);
   }
   else {
-    displays[slot]->showNumberDecEx(timeLeft, 0x00, true, 2, 2);
-    displays[slot]->showNumberDecEx(0, 0x00, true, 2, 0);
+    // Seconds only (SS), left side blank, no colon
+    f[0] = 0;
+    f[1] = 0;
+    f[2] = digitSegments(timeLeft / 10);
+    f[3] = digitSegments(timeLeft % 10);
+    colon = false;
   }
+  
+  if (colon) f[1] |= SEG_COLON;
+}
+
+void clearFrame(int slot) {
+  for (int d = 0; d < 4; d++) frame[slot][d] = 0;
+}
+
+void dashFrame(int slot) {
+  for (int d = 0; d < 4; d++) frame[slot][d] = SEG_G;
+}
+
+// Write only the digits that changed since the last flush. Each bus is
+// one transaction covering the union of its dirty slots' changed digits,
+// so a seconds tick on every slot costs one short write per bus. At most
+// FLUSH_BUDGET buses are written per call, continuing round-robin from
+// where the previous call stopped so no slot is starved.
+void flushDisplays() {
+  static uint8_t cursor = 0;
+  uint8_t written = 0;
+  
+  for (uint8_t n = 0; n < tmBusCount && written < FLUSH_BUDGET; n++) {
+    uint8_t bus = cursor;
+    cursor = (cursor + 1) % tmBusCount;
+    if (flushBus(bus)) written++;
+  }
+}
+
+void flushAllDisplays() {
+  for (uint8_t bus = 0; bus < tmBusCount; bus++) {
+    flushBus(bus);
+  }
+}
+
+bool flushBus(uint8_t bus) {
+  uint8_t active = 0;
+  int first = 4;
+  int last = -1;
+  
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    if (slotBus[slot] != bus) continue;
+    bool dirty = false;
+    for (int d = 0; d < 4; d++) {
+      if (!shownValid[slot] || frame[slot][d] != shown[slot][d]) {
+        if (d < first) first = d;
+        if (d > last) last = d;
+        dirty = true;
+      }
+    }
+    if (dirty) active |= slotDioMask[slot];
+  }
+  if (!active) return false;
+  
+  TmBus& b = tmBuses[bus];
+  uint8_t lowMasks[8];
+  
+  // Data command: write, auto-increment address
+  tmStart(b, active);
+  tmCommonMasks(0x40, active, lowMasks);
+  tmWriteByte(b, active, lowMasks);
+  tmStop(b, active);
+  
+  // Address, then one byte per digit; slots that only changed some of
+  // these digits rewrite the rest unchanged
+  tmStart(b, active);
+  tmCommonMasks(0xC0 + first, active, lowMasks);
+  tmWriteByte(b, active, lowMasks);
+  for (int d = first; d <= last; d++) {
+    for (int bit = 0; bit < 8; bit++) lowMasks[bit] = 0;
+    for (int slot = 0; slot < SLOT_COUNT; slot++) {
+      if (!(active & slotDioMask[slot]) || slotBus[slot] != bus) continue;
+      uint8_t seg = frame[slot][d];
+      for (int bit = 0; bit < 8; bit++) {
+        if (!(seg & (1 << bit))) lowMasks[bit] |= slotDioMask[slot];
+      }
+      shown[slot][d] = seg;
+      profDigits++;
+    }
+    tmWriteByte(b, active, lowMasks);
+  }
+  tmStop(b, active);
+  
+  // Display control: on + brightness
+  tmStart(b, active);
+  tmCommonMasks(tmDisplayCtrl, active, lowMasks);
+  tmWriteByte(b, active, lowMasks);
+  tmStop(b, active);
+  
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    if (slotBus[slot] == bus && (active & slotDioMask[slot])) {
+      shownValid[slot] = true;
+    }
+  }
+  profWrites++;
+  return true;
+}
+
+// Put a slot's display on the bus for its CLK pin and DIO port
+void tmAttach(int slot) {
+  uint8_t clk = DISPLAY_PINS[slot].clk;
+  uint8_t dio = DISPLAY_PINS[slot].dio;
+  uint8_t port = digitalPinToPort(dio);
+  
+  // Released lines with PORT bit 0, as the library leaves them
+  pinMode(clk, INPUT);
+  digitalWrite(clk, LOW);
+  pinMode(dio, INPUT);
+  digitalWrite(dio, LOW);
+  
+  uint8_t bus = 0;
+  while (bus < tmBusCount &&
+         (tmBuses[bus].clkPin != clk || tmBuses[bus].dioPort != port)) {
+    bus++;
+  }
+  if (bus == tmBusCount) {
+    TmBus& b = tmBuses[tmBusCount++];
+    b.clkDdr = portModeRegister(digitalPinToPort(clk));
+    b.clkMask = digitalPinToBitMask(clk);
+    b.dioDdr = portModeRegister(port);
+    b.dioIn = portInputRegister(port);
+    b.clkPin = clk;
+    b.dioPort = port;
+  }
+  slotBus[slot] = bus;
+  slotDioMask[slot] = digitalPinToBitMask(dio);
+}
+
+static inline void tmBitDelay() {
+  delayMicroseconds(TM_BIT_DELAY_US);
+}
+
+void tmStart(TmBus& b, uint8_t active) {
+  *b.dioDdr |= active;  // DIO falls while CLK is high
+  tmBitDelay();
+}
+
+void tmStop(TmBus& b, uint8_t active) {
+  *b.dioDdr |= active;
+  tmBitDelay();
+  *b.clkDdr &= ~b.clkMask;
+  tmBitDelay();
+  *b.dioDdr &= ~active;  // DIO rises while CLK is high
+  tmBitDelay();
+}
+
+// Same byte for every active display: a bit of 0 pulls all their DIOs low
+void tmCommonMasks(uint8_t value, uint8_t active, uint8_t* lowMasks) {
+  for (int bit = 0; bit < 8; bit++) {
+    lowMasks[bit] = (value & (1 << bit)) ? 0 : active;
+  }
+}
+
+// Clock out one byte LSB first; lowMasks[bit] holds the DIO lines to pull
+// low for that bit, so each display can receive a different byte
+void tmWriteByte(TmBus& b, uint8_t active, const uint8_t* lowMasks) {
+  for (int bit = 0; bit < 8; bit++) {
+    *b.clkDdr |= b.clkMask;
+    tmBitDelay();
+    *b.dioDdr = (*b.dioDdr & ~active) | lowMasks[bit];
+    tmBitDelay();
+    *b.clkDdr &= ~b.clkMask;
+    tmBitDelay();
+  }
+  
+  // Acknowledge: release DIO for the ninth clock, each display pulls low
+  *b.clkDdr |= b.clkMask;
+  *b.dioDdr &= ~active;
+  tmBitDelay();
+  *b.clkDdr &= ~b.clkMask;
+  tmBitDelay();
+  uint8_t acked = ~*b.dioIn & active;
+  if (acked != active) tmNacks++;
+  *b.dioDdr |= acked;  // Hold low like the library until the next bit
+  tmBitDelay();
+  *b.clkDdr |= b.clkMask;
+  tmBitDelay();
+}
+
+void runBench() {
+  // Microseconds for one full refresh of every slot, averaged
+  const int rounds = 4;
+  unsigned long savedWrites = profWrites;
+  unsigned long savedDigits = profDigits;
+  
+  unsigned long start = micros();
+  for (int r = 0; r < rounds; r++) {
+    for (int slot = 0; slot < SLOT_COUNT; slot++) {
+      displays[slot]->setSegments(frame[slot], 4, 0);
+    }
+  }
+  unsigned long libUs = (micros() - start) / rounds;
+  
+  start = micros();
+  for (int r = 0; r < rounds; r++) {
+    invalidateDisplays();
+    flushAllDisplays();
+  }
+  unsigned long drvUs = (micros() - start) / rounds;
+  
+  profWrites = savedWrites;
+  profDigits = savedDigits;
+  
+  // BENCH:lib_us,driver_us,buses,nacks
+  Serial.print(F("BENCH:"));
+  Serial.print(libUs);
+  Serial.print(',');
+  Serial.print(drvUs);
+  Serial.print(',');
+  Serial.print(tmBusCount);
+  Serial.print(',');
+  Serial.println(tmNacks);
+}
+
+// Forget what the displays show, e.g. after writing them directly
+void invalidateDisplays() {
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    shownValid[i] = false;
+  }
+}
+
+void updateProfiler(unsigned long loopUs) {
+  profLoops++;
+  if (loopUs > profLoopMaxUs) profLoopMaxUs = loopUs;
+  
+  if (millis() - profWindowStart >= 1000) {
+    profLastLoops = profLoops;
+    profLastWrites = profWrites;
+    profLastDigits = profDigits;
+    profLastFlushUs = profFlushUs;
+    profLastLoopMaxUs = profLoopMaxUs;
+    profLoops = 0;
+    profWrites = 0;
+    profDigits = 0;
+    profFlushUs = 0;
+    profLoopMaxUs = 0;
+    profWindowStart = millis();
+  }
+}
+
+void showProfile() {
+  // PROFILE:loops/s,writes/s,digits/s,flush_us/s,max_loop_us
+  Serial.print(F("PROFILE:"));
+  Serial.print(profLastLoops);
+  Serial.print(',');
+  Serial.print(profLastWrites);
+  Serial.print(',');
+  Serial.print(profLastDigits);
+  Serial.print(',');
+  Serial.print(profLastFlushUs);
+  Serial.print(',');
+  Serial.println(profLastLoopMaxUs);
 }
 
 void testDisplays() {
   // Test pattern for all displays
-  Serial.println("TEST:STARTING");
+  Serial.println(F("TEST:STARTING"));
   
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < SLOT_COUNT; i++) {
     displays[i]->setBrightness(7);
   }
   
   // All segments test
   uint8_t allSegments[] = {0xFF, 0xFF, 0xFF, 0xFF};
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < SLOT_COUNT; i++) {
     displays[i]->setSegments(allSegments);
   }
   delay(500);
   
   // Countdown test
   for (int count = 8888; count >= 0; count -= 1111) {
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < SLOT_COUNT; i++) {
       displays[i]->showNumberDec(count);
     }
     delay(300);
@@ -437,44 +1942,66 @@ void testDisplays() {
   
   // Colon blink test
   for (int i = 0; i < 6; i++) {
-    for (int slot = 0; slot < 4; slot++) {
+    for (int slot = 0; slot < SLOT_COUNT; slot++) {
       displays[slot]->showNumberDecEx(1234, (i % 2) ? 0x40 : 0x00, true);
     }
     delay(300);
   }
   
   // Slot number display
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < SLOT_COUNT; i++) {
     displays[i]->showNumberDec(i+1);
   }
   delay(1000);
   
   // Error display test
-  for (int i = 0; i < 4; i++) {
-    displays[i]->setSegments(SEG_ERR, 3, 0);
+  uint8_t errSegments[sizeof(SEG_ERR)];
+  memcpy_P(errSegments, SEG_ERR, sizeof(SEG_ERR));
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    displays[i]->setSegments(errSegments, sizeof(SEG_ERR), 0);
   }
   delay(1000);
   
   // Reset to normal
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < SLOT_COUNT; i++) {
     displays[i]->setBrightness(brightness);
-    displays[i]->clear();
+    clearFrame(i);
   }
+  invalidateDisplays();
+  flushAllDisplays();
   
-  Serial.println("TEST:COMPLETE");
+  Serial.println(F("TEST:COMPLETE"));
 }
 
 void showHelp() {
-  Serial.println("=== 4-SLOT TIMER HELP ===");
-  Serial.println("SLOTn:value  - Set slot n (1-4) to value (seconds)");
-  Serial.println("              Special values: OFF, -, WAIT");
-  Serial.println("BRIGHT:x     - Set brightness 0-7");
-  Serial.println("PAUSE:n      - Pause slot n");
-  Serial.println("RESUME:n     - Resume slot n");
-  Serial.println("SYNC:n:sec   - Sync slot n to exact seconds");
-  Serial.println("TEST         - Run display test");
-  Serial.println("RESET        - Reset all slots");
-  Serial.println("STATUS       - Show all slot statuses");
-  Serial.println("HELP         - Show this help");
-  Serial.println("========================");
+  Serial.println(F("=== SLOT TIMER HELP ==="));
+  Serial.print(F("SLOTn:value  - Set slot n (1-"));
+  Serial.print(SLOT_COUNT);
+  Serial.println(F(") to value (seconds)"));
+  Serial.println(F("              Special values: OFF, -, WAIT"));
+  Serial.println(F("BRIGHT:x     - Set brightness 0-7"));
+  Serial.println(F("PAUSE:n      - Pause slot n"));
+  Serial.println(F("RESUME:n     - Resume slot n"));
+  Serial.println(F("SYNC:n:sec   - Sync slot n to exact seconds"));
+  Serial.println(F("TIME:ms      - Set shared time base (Pi clock, ms)"));
+  Serial.println(F("DEADLINE:n:t - Run slot n until Pi time t"));
+  Serial.println(F("PAUSE:n:t    - Pause slot n as of Pi time t"));
+  Serial.println(F("RESUME:n:t   - Resume slot n as of Pi time t"));
+  Serial.println(F("TEST         - Run display test"));
+  Serial.println(F("RESET        - Reset all slots"));
+  Serial.println(F("STATUS       - Show all slot statuses"));
+  Serial.println(F("STATUS_BIN   - Send the binary status frame now"));
+  Serial.println(F("PROFILE      - Loop time and display writes/s"));
+  Serial.println(F("DRIFT        - Timekeeping drift statistics"));
+  Serial.println(F("BENCH        - Refresh time: library vs direct driver"));
+  Serial.println(F("SESSION:n:s  - Arm slot n for s seconds, run while plugged in"));
+  Serial.println(F("PLUGCFG:p,u,i - Plug/unplug thresholds (mA), idle timeout (s)"));
+  Serial.println(F("CURRENT      - Show per-slot current and session state"));
+  Serial.println(F("CURRENTRATE:ms - Publish CURRENT every ms (0 = off)"));
+  Serial.println(F("ZERO[:n]     - Auto-zero current sensors with nothing plugged in"));
+  Serial.println(F("ALERTS:n:a,b/f - Alert slot n (0 = all) at a, b.. s, last f s"));
+  Serial.println(F("ALERTS       - Show alert schedules and event queue"));
+  Serial.println(F("EVTACK:ON    - Resend EVT frames until ACK:seq (OFF to stop)"));
+  Serial.println(F("HELP         - Show this help"));
+  Serial.println(F("========================"));
 }
\ No newline at end of file